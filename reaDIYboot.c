@@ -17,12 +17,40 @@
  */
 #include <inttypes.h>
 #include <stdbool.h>
+#include <avr/boot.h>
 #include <avr/interrupt.h>
 #include <avr/io.h>
 #include <avr/pgmspace.h>
 #include <avr/eeprom.h>
+#include <util/crc16.h>
 #include <util/delay.h>
 
+/* The update mailbox already gives the location and the size of the HEX file */
+#if defined(USE_UPDATE_MANIFEST) && defined(USE_UPDATE_MAILBOX)
+#undef USE_UPDATE_MANIFEST
+#endif
+/* The carousel needs the CRC of the image from the server to trust its pages */
+#if defined(UDP_PAGE_CAROUSEL) && !defined(USE_UPDATE_MANIFEST) \
+    && !defined(USE_UPDATE_MAILBOX)
+#undef UDP_PAGE_CAROUSEL
+#endif
+/* The carousel relies on the packed HEX layout to download the missed pages */
+#if defined(UDP_PAGE_CAROUSEL) && !defined(PACKED_HEX_FAST_PATH)
+#define PACKED_HEX_FAST_PATH
+#endif
+/* Only the pages missed by the carousel are scattered across the image */
+#if defined(MULTI_RANGE_REQUESTS) && !defined(UDP_PAGE_CAROUSEL)
+#undef MULTI_RANGE_REQUESTS
+#endif
+/* The update mailbox already tells when the application wants an update */
+#if defined(THROTTLE_UPDATE_CHECKS) && defined(USE_UPDATE_MAILBOX)
+#undef THROTTLE_UPDATE_CHECKS
+#endif
+/* The peak use of the RAM is only reported with the boot telemetry */
+#if defined(MEASURE_RAM_USAGE) && !defined(COLLECT_BOOT_TELEMETRY)
+#undef MEASURE_RAM_USAGE
+#endif
+
 /* WiFly reset pin */
 volatile uint8_t* const RESET_PORT = &PORTL;
 volatile uint8_t* const RESET_PORT_INPUT = &PINL;
@@ -47,6 +75,18 @@ volatile uint8_t* const GPIO6_PORT_INPUT = &PINJ;
 volatile uint8_t* const GPIO6_DDR = &DDRJ;
 uint8_t const GPIO6_PIN = PINJ7;
 
+/* WiFly CTS pin (driven HIGH to stop the WiFly from sending) */
+volatile uint8_t* const CTS_PORT = &PORTJ;
+volatile uint8_t* const CTS_PORT_INPUT = &PINJ;
+volatile uint8_t* const CTS_DDR = &DDRJ;
+uint8_t const CTS_PIN = PINJ3;
+
+/* WiFly RTS pin (driven HIGH by the WiFly when it can't receive) */
+volatile uint8_t* const RTS_PORT = &PORTJ;
+volatile uint8_t* const RTS_PORT_INPUT = &PINJ;
+volatile uint8_t* const RTS_DDR = &DDRJ;
+uint8_t const RTS_PIN = PINJ4;
+
 /* Green LED pin */
 volatile uint8_t* const GREEN_LED_PORT = &PORTD;
 volatile uint8_t* const GREEN_LED_PORT_INPUT = &PIND;
@@ -59,35 +99,109 @@ volatile uint8_t* const RED_LED_PORT_INPUT = &PIND;
 volatile uint8_t* const RED_LED_DDR = &DDRD;
 uint8_t const RED_LED_PIN = PIND4;
 
-/* Use Timer/Counter3 channel A to detect UART timeouts */
-volatile uint16_t* const UART_OCR = &OCR3A;
-uint8_t const UART_OCF = OCF3A;
-
-/* Use Timer/Counter3 channel B to detect WLAN timeouts */
-volatile uint16_t* const WLAN_OCR = &OCR3B;
-uint8_t const WLAN_OCF = OCF3B;
-
-/* Use Timer/Counter3 channel C to detect HTTP timeouts */
-volatile uint16_t* const HTTP_OCR = &OCR3C;
-uint8_t const HTTP_OCF = OCF3C;
+/* Timeouts in Timer/Counter3 periods (64 us) */
+/* UART timeout (4 seconds) */
+uint32_t const UART_TIMEOUT = 0xF424;
+/* WLAN timeout (1 second) */
+uint32_t const WLAN_TIMEOUT = 0x3d09;
+/* HTTP timeout (4 seconds) */
+uint32_t const HTTP_TIMEOUT = 0xF424;
+/* Overall internet update timeout (10 minutes) */
+uint32_t const UPDATE_TIMEOUT = 600UL*(F_CPU/1024);
+/* Carousel timeout, without any new page (10 seconds) */
+uint32_t const CAROUSEL_TIMEOUT = 10UL*(F_CPU/1024);
 
 /* Location of the EEPROM flag */
 uint16_t* const EEPROM_FLAG_ADDRESS = (uint16_t*)(0xFFF - 1);
 /* Value of the EEPROM flag */
 uint16_t const EEPROM_FLAG_VALUE = 0x232e;
 
+/* Location of the update mailbox filled by the application */
+uint8_t* const MAILBOX_EEPROM_ADDRESS = (uint8_t*)0xFC6;
+/* Size of the HEX file location in the update mailbox, including the null */
+#define MAILBOX_PATH_LENGTH 50
+
+/* Location of the download journal (image identity followed by the ring) */
+uint8_t* const JOURNAL_EEPROM_ADDRESS = (uint8_t*)0xF80;
+/* Number of entries in the download journal ring */
+#define JOURNAL_SLOTS 8
+/* Number of Flash pages written between two journal entries */
+#define JOURNAL_PAGE_INTERVAL 4
+
+/* Location of the boot telemetry record */
+uint16_t* const TELEMETRY_EEPROM_ADDRESS = (uint16_t*)0xF40;
+
+/* Location of the fingerprint of the configuration saved in the WiFly */
+uint16_t* const WIFLY_CONFIG_EEPROM_ADDRESS = (uint16_t*)0xF3E;
+
+/* Location of the index of the fastest baud rate that works with the WiFly */
+uint8_t* const WIFLY_BAUD_EEPROM_ADDRESS = (uint8_t*)0xF3D;
+
+/* Location of the server address resolved by the WiFly, then its lifetime */
+uint8_t* const SERVER_ADDRESS_EEPROM_ADDRESS = (uint8_t*)0xF2F;
+/* Number of boots during which the cached server address is trusted */
+#define SERVER_ADDRESS_LIFETIME 64
+
+/* Location of the update check policy and of the progress towards it */
+uint8_t* const THROTTLE_EEPROM_ADDRESS = (uint8_t*)0xF28;
+/* Value of the forced check flag once the check has started */
+#define THROTTLE_NOT_FORCED 0xFF
+/* Value of the forced check flag while a confirmed update isn't installed */
+#define THROTTLE_PENDING 0xFE
+
+/* Location of the descriptor of the image staged by the application */
+uint16_t* const STAGED_IMAGE_EEPROM_ADDRESS = (uint16_t*)0xF34;
+/* Value marking a staged image as complete */
+uint16_t const STAGED_IMAGE_MAGIC = 0x5354;
+/* Start of the staging area (upper half of the Flash memory) */
+uint32_t const STAGING_ADDRESS = (FLASHEND + 1UL)/2;
+
 /* Size of a program page in a HEX file */
 #define HEX_BUFFER_SIZE 4096
-/* Size of a program page in Flash memory (128 words) */
-#define FLASH_PAGE_SIZE 0x80U
+/* Size of a program page in Flash memory in words (128 words) */
+#define FLASH_PAGE_SIZE (SPM_PAGESIZE/2)
+/* Data bytes per record in the packed HEX layout */
+#define PACKED_RECORD_SIZE 128
+/* Size of a record line in the packed HEX layout, "\r\n" included */
+#define PACKED_LINE_SIZE (13 + 2*PACKED_RECORD_SIZE)
+/* Size of the lines holding one Flash page in the packed HEX layout */
+#define PACKED_PAGE_SIZE (2*FLASH_PAGE_SIZE/PACKED_RECORD_SIZE*PACKED_LINE_SIZE)
+/* Size of the marker line at the beginning of the packed HEX layout */
+#define PACKED_HEADER_SIZE 29
+/* Size of the End Of File line at the end of the packed HEX layout */
+#define PACKED_FOOTER_SIZE 13
+/* Record type of the line starting each carousel packet */
+#define CAROUSEL_RECORD_TYPE 0x53
+/* Size of the line starting each carousel packet, "\r\n" included */
+#define CAROUSEL_HEADER_SIZE 21
+/* Size of a carousel packet: the header line and the lines of one page */
+#define CAROUSEL_PACKET_SIZE (CAROUSEL_HEADER_SIZE + PACKED_PAGE_SIZE)
+/* Number of Flash pages of the packed HEX layout that fit in the HEX buffer */
+#define CAROUSEL_CHUNK_PAGES (HEX_BUFFER_SIZE/PACKED_PAGE_SIZE)
+/* Number of Flash pages below the bootloader */
+#define CAROUSEL_MAX_PAGES (BOOTADDRESS/(2*FLASH_PAGE_SIZE))
 /* Size of the buffer used to hold the HEX file location */
 #define PATH_BUFFER_SIZE 64
+/* Number of faster baud rates to try with the WiFly */
+#define WIFLY_FAST_BAUD_RATES 6
+/* Number of raw baud rates at the beginning of WIFLY_FAST_BAUD_RATE */
+#define WIFLY_RAW_BAUD_RATES 3
+/* Size of the trace transmit buffer (must be a power of 2) */
+#define TRACE_BUFFER_SIZE 64
+/* Value written over the free RAM at reset to find the peak of the stack */
+#define STACK_PAINT 0xC5
+/* Size of a trace event in bytes */
+#define TRACE_EVENT_SIZE 6
+/* Reversed polynomial of the CRC-32 (IEEE 802.3) */
+#define CRC32_POLYNOMIAL 0xEDB88320UL
 
 // STK500 protocol
 /* Get parameter value */
 uint8_t const STK_GET_PARAMETER = 0x41;
 /* Leave program mode */
 uint8_t const STK_LEAVE_PROGMODE = 0x51;
+/* Get synchronization */
+uint8_t const STK_GET_SYNC = 0x30;
 /* Load address */
 uint8_t const STK_LOAD_ADDRESS = 0x55;
 /* Program page */
@@ -106,24 +220,32 @@ uint8_t const STK_UNIVERSAL = 0x56;
 uint8_t const STK_SW_MAJOR = 0x81;
 /* Software version minor */
 uint8_t const STK_SW_MINOR = 0x82;
+/* Commands added by reaDIYboot (parameter) */
+uint8_t const STK_EXTENSIONS = 0xE0;
+/* Read the CRC-32 of a Flash range (reaDIYboot extension) */
+uint8_t const STK_READ_CRC32 = 0x7C;
 /* Software version major */
 uint8_t const SW_MAJOR = 0x01;
 /* Software version minor */
 uint8_t const SW_MINOR = 0x10;
 /* No top-card detected */
 uint8_t const NO_TOPCARD_DETECTED = 0x03;
+/* Extensions supported: bit 7 tells them from a top-card, bit 0 is CRC-32 */
+uint8_t const EXTENSIONS = 0x81;
 /* End of packet */
 uint8_t const STK_CRC_EOP = 0x20;
 /* Sent after a valid command has been executed */
 uint8_t const STK_OK = 0x10;
 /* Sent after STK_CRC_EOP has been received */
 uint8_t const STK_INSYNC = 0x14;
-/* Device Signature Byte 1 */
-uint8_t const SIG1 = 0x1E;
+/* Device Signature Byte 1 (from the MCU selected in the makefile) */
+uint8_t const SIG1 = SIGNATURE_0;
 /* Device Signature Byte 2 */
-uint8_t const SIG2 = 0x97;
+uint8_t const SIG2 = SIGNATURE_1;
 /* Device Signature Byte 3 */
-uint8_t const SIG3 = 0x03;
+uint8_t const SIG3 = SIGNATURE_2;
+/* Universal command: Load extended address (beyond 128kB) */
+uint8_t const STK_LOAD_EXTENDED_ADDRESS = 0x4D;
 
 // Error thresholds for the state machines
 /* STK programmer */
@@ -136,6 +258,10 @@ uint8_t const MAX_WLAN_ERRORS = 3;
 uint8_t const MAX_DOWNLOAD_CRITICAL_ERRORS = 3;
 uint8_t const MAX_HTTP_ERRORS = 3;
 uint8_t const MAX_SOCKET_ERRORS = 3;
+uint8_t const MAX_PARSE_ERRORS = 3;
+
+/* Size of the buffer holding the names and values of HTTP header fields */
+#define HTTP_TOKEN_SIZE 16
 
 /* HTTP fields sent with each request */
 char* const HTTP_FIELDS =
@@ -144,6 +270,76 @@ char* const HTTP_FIELDS =
     "Host: " PROGRAM_HOST "\r\n"
     "Connection: Keep-Alive\r\n";
 
+/* Period of the LED blinking while waiting, in Timer/Counter3 periods */
+#define LED_BLINK_PERIOD (F_CPU/1024/4)
+
+/* Trace hooks, compiled out unless ENABLE_UART_TRACE is set */
+#ifdef ENABLE_UART_TRACE
+#define TRACE(type, argument) trace_event(type, argument)
+#else
+#define TRACE(type, argument)
+#endif
+
+/* Background tasks run from the polling loops */
+#if defined(ENABLE_UART_TRACE) || defined(BACKGROUND_TASKS)
+#define TASKS_RUN() tasks_run()
+#else
+#define TASKS_RUN()
+#endif
+
+/* Delays keep the background tasks running when BACKGROUND_TASKS is set */
+#ifdef BACKGROUND_TASKS
+#define WAIT_MS(ms) tasks_wait((uint16_t)((ms)*(F_CPU/1024)/1000))
+#else
+#define WAIT_MS(ms) _delay_ms(ms)
+#endif
+
+/* Boot telemetry hooks, compiled out unless COLLECT_BOOT_TELEMETRY is set */
+#ifdef COLLECT_BOOT_TELEMETRY
+#define TELEMETRY_COUNT(field) (++telemetry.record[field])
+#define TELEMETRY_PHASE(field) telemetry_phase(field)
+#else
+#define TELEMETRY_COUNT(field)
+#define TELEMETRY_PHASE(field)
+#endif
+#ifdef MEASURE_RAM_USAGE
+#define TELEMETRY_PEAK(field, value) telemetry_peak(field, value)
+#else
+#define TELEMETRY_PEAK(field, value)
+#endif
+
+/*
+ * Faster baud rates to try with the WiFly, fastest first. The raw rates come
+ * first: they have no error with a 16 MHz crystal, but they only apply once
+ * saved in the WiFly and after a reboot. The standard rates are switched to
+ * with set uart instant after each reset.
+ */
+uint32_t const WIFLY_FAST_BAUD_RATE[WIFLY_FAST_BAUD_RATES] = {
+    1000000, 500000, 250000, 921600, 460800, 230400
+};
+
+/* Values of the hexadecimal digits from '0' to 'f', 0xFF for other characters */
+uint8_t const IHEX_DIGITS[] PROGMEM = {
+    0, 1, 2, 3, 4, 5, 6, 7, 8, 9,
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+    10, 11, 12, 13, 14, 15,
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+    0xFF, 0xFF,
+    10, 11, 12, 13, 14, 15
+};
+
+/* First line of a HEX file rewritten by tools/hex_pack (record type 0x52) */
+char* const PACKED_HEX_MARKER = ":080000525244425950414B3168\r\n";
+
+/* WiFly commands used to set the program host */
+char* const SET_REMOTE_PORT_COMMAND = "set ip remote 80\r";
+char* const SET_DNS_NAME_COMMAND = "set dns name " PROGRAM_HOST "\r";
+char* const SET_HOST_ADDRESS_COMMAND = "set ip host ";
+/* WiFly command used to resolve the program host, and the start of its reply */
+char* const LOOKUP_HOST_COMMAND = "lookup " PROGRAM_HOST "\r";
+char* const LOOKUP_HOST_REPLY = PROGRAM_HOST "=";
+
 /* Pointer to a string representing the HEX file location */
 #ifdef USE_URL_INDIRECTION
 char* PROGRAM_PATH = 0;
@@ -163,32 +359,131 @@ static void bootload_from_stk(void);
 
 static bool add_error(uint8_t* count, uint8_t max_count);
 
+/* Pages broadcast by a distributor on the LAN */
+#ifdef UDP_PAGE_CAROUSEL
+static int16_t carousel_check_packet(void);
+static bool carousel_check_image(void);
+static bool carousel_decode_line(const uint8_t* source, uint8_t* dest,
+    uint8_t count);
+static bool carousel_has_page(uint16_t page);
+#ifdef MULTI_RANGE_REQUESTS
+static bool carousel_parse_parts(void);
+static void carousel_put_ranges(void);
+#endif
+static bool carousel_read_packet(void);
+static uint8_t carousel_receive(void);
+static void carousel_skip_pages(void);
+#endif
+#if defined(CACHE_WIFLY_CONFIGURATION) || defined(RESUME_INTERRUPTED_DOWNLOAD)
+static uint16_t hash_string(uint16_t hash, const char* source);
+#endif
+
 /* Download management */
 static void download_append_leftover(void);
+#if defined(USE_UPDATE_MANIFEST) \
+    && (defined(CLEAR_STATUS_AFTER_DOWNLOAD) || defined(THROTTLE_UPDATE_CHECKS))
+static bool download_check_image(void);
+#endif
+#ifdef PACKED_HEX_FAST_PATH
+static bool download_check_packed(void);
+#endif
 static bool download_get_chunk(void);
+#ifdef USE_UPDATE_MANIFEST
+static bool download_get_manifest(void);
+#endif
 static bool download_get_path(void);
+#if !defined(USE_UPDATE_MANIFEST) && !defined(USE_UPDATE_MAILBOX)
 static bool download_get_size(void);
+#endif
 static bool download_get_status(void);
 static bool download_parse_chunk(void);
+static bool download_parse_location(void);
+#ifdef USE_UPDATE_MANIFEST
+static bool download_parse_manifest(void);
+#endif
 static bool download_parse_path(void);
+#if !defined(USE_UPDATE_MANIFEST) && !defined(USE_UPDATE_MAILBOX)
 static bool download_parse_size(void);
+#endif
+static bool download_parse_status(void);
 static void download_update_status(void);
 
 /* Read device ID from EEPROM */
 static void eeprom_read_id(void);
 
+/* Flash services exported to the application */
+#ifdef EXPORT_FLASH_SERVICES
+// The services are only referenced by the jump table
+#define FLASH_SERVICE __attribute__((used))
+#else
+#define FLASH_SERVICE
+#endif
+#if defined(EXPORT_FLASH_SERVICES) || defined(USE_UPDATE_MAILBOX) \
+    || defined(UDP_PAGE_CAROUSEL) \
+    || (defined(USE_UPDATE_MANIFEST) && (defined(CLEAR_STATUS_AFTER_DOWNLOAD) \
+    || defined(THROTTLE_UPDATE_CHECKS)))
+static uint16_t flash_crc16(uint32_t address, uint32_t size) FLASH_SERVICE;
+#endif
+#ifdef STK_CRC_EXTENSION
+static uint32_t flash_crc32(uint32_t address, uint32_t size);
+#endif
+#ifdef EXPORT_FLASH_SERVICES
+static bool flash_erase_page(uint32_t address) FLASH_SERVICE;
+static void flash_install_staged_image(void);
+static bool flash_write_page(uint32_t address, const uint8_t* data)
+    FLASH_SERVICE;
+#endif
+
+/* Download progress journal */
+#ifdef RESUME_INTERRUPTED_DOWNLOAD
+static void journal_clear(void);
+static void journal_commit(void);
+static uint16_t journal_hash_image(void);
+static void journal_restore(void);
+static void journal_skip(void);
+static void journal_write_entry(void);
+#endif
+
+/* Update mailbox filled by the application */
+#ifdef USE_UPDATE_MAILBOX
+static void mailbox_close(void);
+static bool mailbox_read(void);
+#endif
+
+/* SRAM usage */
+#ifdef MEASURE_RAM_USAGE
+static void ram_paint_stack(void)
+    __attribute__((naked, used, section(".init1")));
+static uint16_t ram_stack_depth(void);
+#endif
+
 /* Send HTTP requests */
 static bool http_await_response(void);
+static void http_drain(void);
+static bool http_parse_header(void);
+static uint8_t http_read_number(uint32_t* number, uint8_t separator);
+static uint8_t http_read_token(uint8_t* token, uint8_t separator);
 static bool http_send(void (*request)(void), bool (*action)(void));
+static bool http_token_is(const uint8_t* token, const char* name);
 static void request_get_chunk(void);
+#ifdef USE_UPDATE_MANIFEST
+static void request_get_manifest(void);
+#endif
+#if !defined(USE_UPDATE_MANIFEST) && !defined(USE_UPDATE_MAILBOX)
 static void request_get_size(void);
+#endif
 static void request_get_status(void);
 static void request_update_status(void);
 
+/* Server address cached in the EEPROM */
+#ifdef CACHE_SERVER_ADDRESS
+static void server_load_address(void);
+#endif
+
 /* iHEX data format */
-static bool ihex_check_line(void);
-static bool ihex_load_byte(void);
-static uint8_t ihex_parse_byte(uint8_t* source);
+static uint8_t ihex_check_line(void);
+static bool ihex_load_bytes(void);
+static int16_t ihex_parse_byte(const uint8_t* source);
 
 /* STK communication protocol */
 static void stk_byte_response(uint8_t);
@@ -211,16 +506,92 @@ static void wifly_put_char(uint8_t ch);
 static void wifly_put_string(const char* source);
 static void wifly_put_long(uint32_t number);
 static void wifly_reset(void);
+static void wifly_reset_baud_rate(void);
+#ifdef NEGOTIATE_WIFLY_BAUD_RATE
+static bool wifly_save_baud_rate(uint32_t rate);
+#endif
+static void wifly_set_baud_rate(uint32_t rate);
+#ifdef NEGOTIATE_WIFLY_BAUD_RATE
+static bool wifly_negotiate_baud_rate(void);
+static enum baud_rate_status wifly_switch_baud_rate(uint8_t index);
+#endif
+#ifdef CACHE_WIFLY_CONFIGURATION
+static uint16_t wifly_config_hash(void);
+#endif
 static bool wifly_set_host(void);
+#ifdef CACHE_SERVER_ADDRESS
+static bool wifly_lookup_host(void);
+#endif
+
+/* Boot telemetry */
+#ifdef COLLECT_BOOT_TELEMETRY
+static void telemetry_close(void);
+static void telemetry_end_chunk(void);
+static void telemetry_peak(uint8_t field, uint16_t value);
+static void telemetry_phase(uint8_t field);
+static void telemetry_put_query(void);
+static void telemetry_save(void);
+#endif
+
+/* Cooperative background tasks */
+#ifdef BACKGROUND_TASKS
+static void tasks_flash(void);
+static void tasks_leds(void);
+#endif
+#if defined(ENABLE_UART_TRACE) || defined(BACKGROUND_TASKS)
+static void tasks_run(void);
+#endif
+#if defined(BACKGROUND_TASKS) && !defined(ENABLE_UART_TRACE)
+static void tasks_stk(void);
+#endif
+#ifdef BACKGROUND_TASKS
+static void tasks_wait(uint16_t ticks);
+#endif
+
+/* Binary trace on UART0 */
+#ifdef ENABLE_UART_TRACE
+static void trace_event(uint8_t type, uint16_t argument);
+static void trace_flush(void);
+static void trace_poll(void);
+static void trace_start(void);
+#endif
+
+/* Timer/Counter3 timebase */
+static bool timer_expired(uint32_t deadline);
+static uint32_t timer_read(void);
+
+/* Update check throttling */
+#ifdef THROTTLE_UPDATE_CHECKS
+static bool throttle_check_due(void);
+#endif
 
 /* Core self-programming function */
 static void write_bin_page(void);
+#ifdef BACKGROUND_TASKS
+static void write_bin_page_finish(void);
+#endif
+
+/* Outcomes of listening to the carousel of a distributor */
+enum carousel_status {
+    CAROUSEL_ABSENT,
+    CAROUSEL_INSTALLED,
+    CAROUSEL_PARTIAL,
+    CAROUSEL_COMPLETE
+};
+
+/* Outcomes of an attempt to move the WiFly to a faster baud rate */
+enum baud_rate_status {
+    BAUD_RATE_SWITCHED,
+    BAUD_RATE_REJECTED,
+    BAUD_RATE_NO_COMMAND_MODE
+};
 
 /* Possible states for the WiFly state machine */
 enum wifly_state {
     RESETTING,
     SETTING_HOST,
     JOINING_WLAN,
+    RESOLVING_HOST,
     OPENING_SOCKET,
     WIFLY_CRITICAL_ERROR
 };
@@ -234,6 +605,13 @@ enum download_state {
     DOWNLOAD_CRITICAL_ERROR
 };
 
+/* Possible outcomes of the check of a HEX line */
+enum ihex_line_status {
+    HEX_LINE_INCOMPLETE,
+    HEX_LINE_VALID,
+    HEX_LINE_INVALID
+};
+
 /* Possible states for the internet bootloader state machine */
 enum bootloader_state {
     ENTERING,
@@ -247,41 +625,222 @@ enum bootloader_state {
 
 struct wifly_struct {
     enum wifly_state state;
+    bool command_mode;
+    bool rts_stuck;
     struct {
         uint8_t command;
         uint8_t critical;
         uint8_t wlan;
         uint8_t socket;
     } errors;
-} wifly = {RESETTING, {0, 0, 0, 0}};
+} wifly = {RESETTING, false, false, {0, 0, 0, 0}};
 
 struct download_struct {
     enum download_state state;
+    bool found;
     struct {
         uint8_t critical;
         uint8_t http;
         uint8_t parse;
     } errors;
-} download = {CHECKING_SOCKET, {0, 0, 0}};
-
-/* Binary program page */
+} download = {CHECKING_SOCKET, false, {0, 0, 0}};
+
+/* Framing of the HTTP responses on the persistent socket */
+struct http_struct {
+    uint32_t remaining;
+    bool body;
+    bool close;
+    bool framed;
+    bool multipart;
+    uint16_t etag;
+} http = {0, false, false, true, false, 5381};
+
+/* HEX file chunk */
 struct hex_chunk_struct {
     uint32_t file_start;
     uint32_t file_stop;
     uint16_t size;
     uint16_t index;
-} hex_chunk = {0, 0, 0, 0};
+    uint16_t line;
+    bool packed;
+} hex_chunk = {0, 0, 0, 0, 0, false};
+
+/*
+ * Fields of the boot telemetry record. Durations are expressed in units of
+ * 256 Timer/Counter3 periods (16.384 ms) and each phase only accounts for the
+ * time spent outside of the phases nested in it.
+ */
+enum telemetry_field {
+    TIME_RESET,
+    TIME_COMMAND,
+    TIME_JOIN,
+    TIME_SOCKET,
+    TIME_STATUS,
+    TIME_HEAD,
+    TIME_CHUNKS,
+    TIME_PARSE,
+    TIME_FLASH,
+    TIME_RETRY,
+    TIME_SLOWEST_CHUNK,
+    TIME_TOTAL,
+    COUNT_CHUNKS,
+    COUNT_PAGES,
+    COUNT_COMMAND_ERRORS,
+    COUNT_WLAN_ERRORS,
+    COUNT_SOCKET_ERRORS,
+    COUNT_HTTP_ERRORS,
+    COUNT_WIFLY_RESETS,
+    COUNT_DOWNLOAD_RESETS,
+#ifdef MEASURE_RAM_USAGE
+    PEAK_HEX_BUFFER,
+    PEAK_BIN_BUFFER,
+    PEAK_STACK,
+#endif
+    TELEMETRY_FIELDS
+};
+
+/* Boot telemetry state */
+struct telemetry_struct {
+    uint32_t start;
+    uint32_t phase_start;
+    uint32_t chunk_start;
+    uint8_t phase;
+    uint16_t record[TELEMETRY_FIELDS];
+} telemetry;
+
+/* Number of Timer/Counter3 overflows since reset */
+uint16_t timer_overflows;
+
+/* Sources of the timeouts reported in the trace */
+enum timeout_source {
+    UART_TIMEOUT_SOURCE = 1,
+    WLAN_TIMEOUT_SOURCE,
+    HTTP_TIMEOUT_SOURCE
+};
+
+/*
+ * Types of trace events. Each event is sent as a 6-byte record: the type
+ * OR'ed with 0xA0, a 24-bit little endian timestamp in Timer/Counter3 periods
+ * (64 us) and a 16-bit little endian argument.
+ */
+enum trace_type {
+    TRACE_BOOT_STATE,
+    TRACE_WIFLY_STATE,
+    TRACE_DOWNLOAD_STATE,
+    TRACE_BYTES_RECEIVED,
+    TRACE_TIMEOUT,
+    TRACE_PAGE_WRITTEN,
+    TRACE_EVENTS_DROPPED
+};
+
+/* State of the background tasks */
+struct tasks_struct {
+    uint32_t led_deadline;
+    uint8_t leds;
+} tasks;
+
+/* Trace transmit buffer */
+struct trace_struct {
+    uint8_t head;
+    uint8_t tail;
+    uint8_t dropped;
+    uint8_t buffer[TRACE_BUFFER_SIZE];
+} trace;
+
+/*
+ * Header of the update mailbox, followed in the EEPROM by the HEX file
+ * location. The checksum is the CRC-16 of the binary image.
+ */
+struct mailbox_struct {
+    uint32_t size;
+    uint16_t checksum;
+} mailbox;
+
+/* Checksum of the binary image given by the update manifest */
+struct manifest_struct {
+    uint16_t checksum;
+    bool verify;
+} manifest;
+
+/* Descriptor of an image staged by the application, stored in the EEPROM */
+struct staged_image_struct {
+    uint32_t size;
+    uint16_t crc;
+    uint16_t magic;
+};
+
+/*
+ * Server address cached in the EEPROM, 0.0.0.0 when the WiFly must use the
+ * DNS name, and number of boots before it is looked up again
+ */
+struct server_struct {
+    uint8_t address[4];
+    uint8_t lifetime;
+} server;
+
+/*
+ * Update check policy stored in the EEPROM: the intervals are set by the
+ * application, which also counts the hours of uptime since the last check.
+ * An erased interval is ignored, and an erased policy checks on every boot.
+ */
+struct throttle_struct {
+    uint8_t forced;
+    uint8_t boot_interval;
+    uint8_t boots;
+    uint16_t hour_interval;
+    uint16_t hours;
+} throttle;
+
+/*
+ * Image broadcast by a distributor, with a bit per page received. The stop
+ * offset ends the run of missed pages requested from the HTTP server. The
+ * pages of a multipart response are listed in the order of the HEX buffer.
+ */
+struct carousel_struct {
+    uint16_t count;
+    uint16_t crc;
+    uint32_t stop;
+    uint8_t record[4];
+    uint8_t received[(CAROUSEL_MAX_PAGES + 7)/8];
+    uint8_t ranges;
+    bool single_range;
+    uint8_t pages;
+    uint8_t next;
+    uint16_t chunk[CAROUSEL_CHUNK_PAGES];
+} carousel;
 
 /* Binary program page */
 struct bin_page_struct {
-    uint16_t address;
+    uint32_t address;
     uint16_t index;
 } bin_page = {0x0000, 0};
 
+/* Identity of the image described by the download journal */
+struct journal_header_struct {
+    uint32_t size;
+    uint16_t image_hash;
+};
+
+/* Progress entry of the download journal */
+struct journal_entry_struct {
+    uint8_t sequence;
+    uint32_t line_offset;
+    uint16_t page;
+    uint8_t skip;
+};
+
+/* Download journal state */
+struct journal_struct {
+    uint8_t slot;
+    uint8_t pages;
+    uint8_t skip;
+    struct journal_entry_struct entry;
+} journal;
+
 /* Target address in Flash memory */
 union address_union {
-  uint16_t word;
-  uint8_t byte[2];
+  uint32_t word;
+  uint8_t byte[4];
 } address;
 
 /* Source block byte count */
@@ -305,6 +864,8 @@ bool stk_timeout;
 uint32_t hex_program_size;
 /* Byte count of the current line in the HEX file */
 uint8_t line_byte_count;
+/* Sum of the bytes of the current line in the HEX file */
+uint8_t line_checksum;
 /* Buffer used for unsigned-to-ASCII conversions */
 char utoa_buffer[7];
 /* Function pointer to the start of the application */
@@ -321,11 +882,23 @@ void main(void)
     WDTCSR |= (1 << WDCE) | (1 << WDE);
     WDTCSR = 0x00;
 
+#ifdef EXPORT_FLASH_SERVICES
+    // Install an image staged by the application first, since the
+    // application usually resets through the Watchdog Timer
+    flash_install_staged_image();
+#endif
+
     // If the last reset was triggered by the watchdog timer, skip the
     // bootloader and start the main program.
     if (status_register & (1 << WDRF))
         app_start();
 
+#ifdef EIND
+    // Indirect calls must stay in the upper 128kB of the Flash memory, where
+    // the bootloader sits on the ATmega2560
+    EIND = BOOTADDRESS >> 17;
+#endif
+
     // Set the LED pins as outputs
     *GREEN_LED_DDR |= (1 << GREEN_LED_PIN);
     *RED_LED_DDR |= (1 << RED_LED_PIN);
@@ -338,6 +911,15 @@ void main(void)
     *GPIO6_DDR &= ~(1 << GPIO6_PIN);
     // Enable internal pull-up resistor
     *GPIO4_PORT |= (1 << GPIO4_PIN);
+#ifdef WIFLY_FLOW_CONTROL
+    // Set the CTS pin as an output and let the WiFly send
+    *CTS_DDR |= (1 << CTS_PIN);
+    *CTS_PORT &= ~(1 << CTS_PIN);
+    // Set the RTS pin as an input with a pull-up, so that an unconnected pin
+    // holds the transmission
+    *RTS_DDR &= ~(1 << RTS_PIN);
+    *RTS_PORT |= (1 << RTS_PIN);
+#endif
 
     // Initialize UART0 (for the STK programmer)
     UBRR0L = (uint8_t)(F_CPU/(STK_BAUD_RATE*16L) - 1);
@@ -350,31 +932,21 @@ void main(void)
     PORTE |= (1 << PINE0);
 
     // Initialize UART1 (for the Wi-Fi module)
-#if WIFLY_BAUD_RATE >= 115200
-    UBRR1L = (uint8_t)(F_CPU/(WIFLY_BAUD_RATE*4L) - 1)/2;
-    UBRR1H = (F_CPU/(WIFLY_BAUD_RATE*4L) - 1)/2 >> 8;
-    UCSR1A = (1 << U2X1);
-#else
-    UBRR1L = (uint8_t)(F_CPU/(WIFLY_BAUD_RATE*8L) - 1)/2;
-    UBRR1H = (F_CPU/(WIFLY_BAUD_RATE*8L) - 1)/2 >> 8;
-    UCSR1A = 0x00;
-#endif
+    wifly_reset_baud_rate();
     UCSR1B = (1 << TXEN1)|(1 << RXEN1);
     UCSR1C = (1 << UCSZ11)|(1 << UCSZ10);
 
-    // Set Timer3 to normal mode
+    // Set Timer3 to normal mode, it runs freely and timeouts are computed
+    // as deadlines
     TCCR3A = 0x00;
     // Set the prescaler to 1024
     TCCR3B = (1 << CS32) | (1 << CS30);
-    // Set the WLAN timeout to 1 second
-    *WLAN_OCR = 0x3d09;
-    // Set the UART timeout to 4 seconds
-    *UART_OCR = 0xF424;
-    // Set the HTTP timeout to 4 seconds
-    *HTTP_OCR = 0xF424;
 
     // Try to bootload using the STK protocol on UART0.
     bootload_from_stk();
+#ifdef BACKGROUND_TASKS
+    write_bin_page_finish();
+#endif
 
     // If the EEPROM flag doesn't have the magic value, don't try to bootload
     // from the internet.
@@ -382,6 +954,21 @@ void main(void)
         WDTCSR = (1 << WDE);
         while (1);
     }
+#ifdef USE_UPDATE_MAILBOX
+    // Don't even start the Wi-Fi module unless the application asked for an
+    // update
+    if (!mailbox_read()) {
+        WDTCSR = (1 << WDE);
+        while (1);
+    }
+#endif
+#ifdef THROTTLE_UPDATE_CHECKS
+    // Keep the boots between two update checks off the network
+    if (!throttle_check_due()) {
+        WDTCSR = (1 << WDE);
+        while (1);
+    }
+#endif
 
     // Try to bootload using the Wi-Fi module on UART1 to fetch a program from
     // the internet.
@@ -392,16 +979,45 @@ void main(void)
 
 static void bootload_from_internet(void)
 {
+    uint32_t deadline = timer_read() + UPDATE_TIMEOUT;
+
 #ifdef USE_DEVICE_ID
     eeprom_read_id();
+#endif
+#ifdef CACHE_SERVER_ADDRESS
+    server_load_address();
+#endif
+#ifdef COLLECT_BOOT_TELEMETRY
+    // Start measuring from the end of the STK window
+    telemetry.start = timer_read();
+    telemetry.phase_start = telemetry.start;
+#endif
+#ifdef ENABLE_UART_TRACE
+    trace_start();
 #endif
     do {
+        TASKS_RUN();
+        // Give up if the update takes too long, unless the last page of the
+        // image is about to be written
+        if (boot_state != EXITING && timer_expired(deadline))
+            boot_state = JUMPING_TO_APP;
         if (boot_state == ENTERING) {
+            TRACE(TRACE_BOOT_STATE, ENTERING);
+            TELEMETRY_PHASE(TIME_RESET);
             // Reset the Wi-Fi module in case it was left in a hanging state
             wifly_reset();
             // Switch led color to red
             *RED_LED_PORT |= (1 << RED_LED_PIN);
             *GREEN_LED_PORT &= ~(1 << GREEN_LED_PIN);
+            // The update mailbox already gives the location and the size of
+            // the HEX file
+#ifndef USE_UPDATE_MAILBOX
+#ifdef USE_UPDATE_MANIFEST
+            // A single request gives the status, the location and the size
+            if (!download_get_manifest())
+                boot_state = JUMPING_TO_APP;
+            else
+#else
 #ifdef CHECK_STATUS_BEFORE_DOWNLOAD
             // Check if an update is available
             if (!download_get_status())
@@ -417,17 +1033,62 @@ static void bootload_from_internet(void)
             if (!download_get_size())
                 boot_state = JUMPING_TO_APP;
             else
+#endif
+#endif
+            {
                 boot_state = FILLING_BUFFER;
+#ifdef THROTTLE_UPDATE_CHECKS
+                // Check again on every boot until the update is installed
+                eeprom_update_byte(THROTTLE_EEPROM_ADDRESS, THROTTLE_PENDING);
+#endif
+#ifdef UDP_PAGE_CAROUSEL
+                // Take the pages broadcast on the LAN only once the server has
+                // confirmed the update, then download the others
+                uint8_t carousel_status = carousel_receive();
+                // An image that is already installed is closed like a
+                // complete one, so that the update status is cleared
+                if (carousel_status == CAROUSEL_INSTALLED
+                    || carousel_status == CAROUSEL_COMPLETE)
+                    boot_state = EXITING;
+#endif
+#ifdef RESUME_INTERRUPTED_DOWNLOAD
+                // Pick up where an interrupted download of the same image
+                // left off
+#ifdef UDP_PAGE_CAROUSEL
+                if (carousel.count == 0)
+#endif
+                journal_restore();
+#endif
+            }
         }
         else if (boot_state == FILLING_BUFFER) {
             // Switch led color to orange
             *RED_LED_PORT |= (1 << RED_LED_PIN);
             *GREEN_LED_PORT |= (1 << GREEN_LED_PIN);
+#ifdef COLLECT_BOOT_TELEMETRY
+            telemetry.chunk_start = timer_read();
+#endif
+            TRACE(TRACE_BOOT_STATE, FILLING_BUFFER);
+#ifdef UDP_PAGE_CAROUSEL
+            carousel_skip_pages();
+#endif
+            // A download that ends on a page boundary, after a packed image or
+            // the last pages of the carousel, reaches EXITING with an empty
+            // binary page, which is skipped there
             if (hex_chunk.file_start == hex_program_size) {
                 boot_state = EXITING;
             }
             // Fetch the next chunk of HEX data
             else if (download_get_chunk()) {
+#ifdef COLLECT_BOOT_TELEMETRY
+                telemetry_end_chunk();
+#endif
+#ifdef PACKED_HEX_FAST_PATH
+                if (hex_chunk.file_start == 0)
+                    hex_chunk.packed = download_check_packed();
+#endif
+                TRACE(TRACE_BYTES_RECEIVED,
+                    hex_chunk.file_stop - hex_chunk.file_start + 1);
                 // Reset the HEX buffer indexes
                 hex_chunk.size += hex_chunk.index;
                 hex_chunk.index = 0;
@@ -437,15 +1098,48 @@ static void bootload_from_internet(void)
                 boot_state = JUMPING_TO_APP;
         }
         else if (boot_state == CHECKING_HEX_LINE) {
+            TELEMETRY_PHASE(TIME_PARSE);
             // Switch led color to orange
             *RED_LED_PORT |= (1 << RED_LED_PIN);
             *GREEN_LED_PORT |= (1 << GREEN_LED_PIN);
-            if (ihex_check_line()) {
+            uint8_t line_status = ihex_check_line();
+            if (line_status == HEX_LINE_VALID) {
+#ifdef RESUME_INTERRUPTED_DOWNLOAD
+                // Skip the bytes of a resumed line that are already in Flash
+                journal_skip();
+#endif
                 boot_state = PARSING_HEX_LINE;
             }
+            else if (line_status == HEX_LINE_INVALID
+                && !add_error(&download.errors.parse, MAX_PARSE_ERRORS)) {
+                boot_state = JUMPING_TO_APP;
+            }
             else {
-                hex_chunk.file_start = hex_chunk.file_stop + 1;
-                download_append_leftover();
+                if (line_status == HEX_LINE_INVALID
+#ifdef PACKED_HEX_FAST_PATH
+                    || hex_chunk.packed
+#endif
+                    ) {
+                    // Request the line again instead of moving it to the
+                    // beginning of the buffer, a corrupted line being
+                    // downloaded again from its start code
+                    hex_chunk.file_start = hex_chunk.file_stop + 1
+                        - hex_chunk.size + hex_chunk.index;
+#ifdef MULTI_RANGE_REQUESTS
+                    // The lines of a multipart response aren't contiguous in
+                    // the file, so request the whole page again
+                    if (carousel.pages != 0) {
+                        bin_page.index = 0;
+                        carousel.pages = 0;
+                    }
+#endif
+                    hex_chunk.size = 0;
+                    hex_chunk.index = 0;
+                }
+                else {
+                    hex_chunk.file_start = hex_chunk.file_stop + 1;
+                    download_append_leftover();
+                }
                 boot_state = FILLING_BUFFER;
             }
         }
@@ -456,10 +1150,12 @@ static void bootload_from_internet(void)
             if (bin_page.index == 2*FLASH_PAGE_SIZE) {
                 boot_state = WRITING_BIN_PAGE;
             }
-            else if (!ihex_load_byte())
+            else if (!ihex_load_bytes())
                 boot_state = CHECKING_HEX_LINE;
         }
         else if (boot_state == WRITING_BIN_PAGE) {
+            TELEMETRY_PHASE(TIME_FLASH);
+            TELEMETRY_COUNT(COUNT_PAGES);
             // Switch led color to green
             *RED_LED_PORT &= ~(1 << RED_LED_PIN);
             *GREEN_LED_PORT |= (1 << GREEN_LED_PIN);
@@ -469,31 +1165,94 @@ static void bootload_from_internet(void)
             address.word = bin_page.address;
             // Write the binary page to Flash
             write_bin_page();
+            // The word address doesn't fit in the argument on the ATmega2560,
+            // so trace the index of the page
+            TRACE(TRACE_PAGE_WRITTEN, bin_page.address/FLASH_PAGE_SIZE);
+            // The rest of the chunk is parsed before the next page write
+            TELEMETRY_PHASE(TIME_PARSE);
             // The address is a word location whereas the size is a byte count,
             // so divide it by 2
             bin_page.address += length.word >> 1;
             // Reset the binary page index
             bin_page.index = 0;
+            // The download makes progress, forgive the corrupted lines
+            download.errors.parse = 0;
+#ifdef MULTI_RANGE_REQUESTS
+            // The next part of a multipart response goes to its own page
+            if (carousel.next < carousel.pages)
+                bin_page.address =
+                    (uint32_t)carousel.chunk[carousel.next++]*FLASH_PAGE_SIZE;
+#endif
+#ifdef RESUME_INTERRUPTED_DOWNLOAD
+            // Record the progress in the EEPROM
+#ifdef MULTI_RANGE_REQUESTS
+            if (carousel.pages == 0)
+#endif
+            journal_commit();
+#endif
             boot_state = PARSING_HEX_LINE;
         }
         else if (boot_state == EXITING) {
+            TRACE(TRACE_BOOT_STATE, EXITING);
+            TELEMETRY_PHASE(TIME_FLASH);
             // Switch led color to green
             *RED_LED_PORT &= ~(1 << RED_LED_PIN);
             *GREEN_LED_PORT |= (1 << GREEN_LED_PIN);
-            // Update page byte count
-            length.word = bin_page.index;
-            // Update target Flash location
-            address.word = bin_page.address;
-            // Write the binary page to Flash
-            write_bin_page();
+            // An image that ends on a page boundary, such as a packed one,
+            // leaves no partial page to write
+            if (bin_page.index != 0) {
+                TELEMETRY_COUNT(COUNT_PAGES);
+                // Update page byte count
+                length.word = bin_page.index;
+                // Update target Flash location
+                address.word = bin_page.address;
+                // Write the binary page to Flash
+                write_bin_page();
+                TRACE(TRACE_PAGE_WRITTEN, bin_page.address/FLASH_PAGE_SIZE);
+            }
+#ifdef BACKGROUND_TASKS
+            // Complete the last Page Write before the EEPROM writes below
+            write_bin_page_finish();
+#endif
+#ifdef RESUME_INTERRUPTED_DOWNLOAD
+            // The image is complete, the next download must start over
+            journal_clear();
+#endif
+#ifdef USE_UPDATE_MAILBOX
+            mailbox_close();
+#endif
+#if defined(CLEAR_STATUS_AFTER_DOWNLOAD) || defined(THROTTLE_UPDATE_CHECKS)
+#ifdef USE_UPDATE_MANIFEST
+            // Leave the update pending if the image doesn't match the
+            // manifest, so that it is downloaded again on the next boot
+            if (download_check_image())
+#endif
+            {
 #ifdef CLEAR_STATUS_AFTER_DOWNLOAD
-            download_update_status();
+                download_update_status();
+#endif
+#ifdef THROTTLE_UPDATE_CHECKS
+                eeprom_update_byte(THROTTLE_EEPROM_ADDRESS, THROTTLE_NOT_FORCED);
+#endif
+            }
 #endif
             boot_state = JUMPING_TO_APP;
         }
         else if (boot_state == JUMPING_TO_APP) {
             *GREEN_LED_PORT &= ~(1 << GREEN_LED_PIN);
             *RED_LED_PORT &= ~(1 << RED_LED_PIN);
+#ifdef BACKGROUND_TASKS
+            // Complete the last Page Write before the telemetry is saved
+            write_bin_page_finish();
+#endif
+#ifdef COLLECT_BOOT_TELEMETRY
+            telemetry_save();
+#endif
+#ifdef ENABLE_UART_TRACE
+            TRACE(TRACE_BOOT_STATE, JUMPING_TO_APP);
+            // Send the end of the trace before the reset
+            trace_flush();
+#endif
             // Watchdog Timer reset
             WDTCSR = (1 << WDE);
             while (1);
@@ -506,8 +1265,12 @@ static void bootload_from_stk(void)
 {
     uint16_t b;
     uint8_t ch, ch2;
-    // RAMPZ Flag used to indicate memory writes beyond the 64kB boundary
-    uint8_t flag_rampz;
+    // Byte address of the Flash memory read
+    uint32_t read_address;
+#ifdef STK_CRC_EXTENSION
+    // Byte count of the Flash range, then its CRC-32
+    uint32_t crc_length;
+#endif
 
      while (!stk_timeout && stk_errors < MAX_STK_ERROR_COUNT) {
         ch = stk_get_char();
@@ -523,6 +1286,12 @@ static void bootload_from_stk(void)
             else if (ch2 == STK_SW_MINOR) {
                 stk_byte_response(SW_MINOR);
             }
+#ifdef STK_CRC_EXTENSION
+            // Commands added by reaDIYboot
+            else if (ch2 == STK_EXTENSIONS) {
+                stk_byte_response(EXTENSIONS);
+            }
+#endif
             // Required by AVR Studio
             else {
                 stk_byte_response(NO_TOPCARD_DETECTED);
@@ -531,13 +1300,17 @@ static void bootload_from_stk(void)
         // Leave program mode
         else if (ch == STK_LEAVE_PROGMODE) {
             stk_nothing_response();
+#ifdef BACKGROUND_TASKS
+            write_bin_page_finish();
+#endif
             // Watchdog Timer reset
             WDTCSR = (1 << WDE);
             while (1);
         }
         // Load word address
         else if (ch == STK_LOAD_ADDRESS) {
-            // Address is little endian and is in words
+            // Address is little endian and is in words, the upper byte is
+            // set by the Load extended address universal command
             address.byte[0] = stk_get_char();
             address.byte[1] = stk_get_char();
             stk_nothing_response();
@@ -565,35 +1338,58 @@ static void bootload_from_stk(void)
         // Read page
         else if (ch == STK_READ_PAGE) {
             *GREEN_LED_PORT |= (1 << GREEN_LED_PIN);
+#ifdef BACKGROUND_TASKS
+            // The last page written must be readable
+            write_bin_page_finish();
+#endif
             // Length is big endian and is in bytes
             length.byte[1] = stk_get_char();
             length.byte[0] = stk_get_char();
-            if (address.word > 0x7FFF) {
-                flag_rampz = 1;
-            }
-            else {
-                flag_rampz = 0;
-            }
             // Since the address sent via STK is the word address, address*2
             // yields the byte address
-            address.word = address.word << 1;
+            read_address = address.word << 1;
             stk_get_char();
             if (stk_get_char() == STK_CRC_EOP) {
                 stk_put_char(STK_INSYNC);
                 for (b = 0; b < length.word; b++) {
-                    if (!flag_rampz) {
-                        stk_put_char(pgm_read_byte_near(address.word));
-                    }
-                    else {
-                        stk_put_char(pgm_read_byte_far(address.word +
-                            0x10000));
-                    }
-                    address.word++;
+                    stk_put_char(pgm_read_byte_far(read_address));
+                    read_address++;
+                }
+                stk_put_char(STK_OK);
+            }
+            *GREEN_LED_PORT &= ~(1 << GREEN_LED_PIN);
+        }
+#ifdef STK_CRC_EXTENSION
+        // Read the CRC-32 of a Flash range, so that the programmer doesn't
+        // have to read it back to verify it
+        else if (ch == STK_READ_CRC32) {
+            *GREEN_LED_PORT |= (1 << GREEN_LED_PIN);
+#ifdef BACKGROUND_TASKS
+            // The last page written must be readable
+            write_bin_page_finish();
+#endif
+            // Length is big endian and is in bytes, the range starts at the
+            // loaded address
+            crc_length = 0;
+            for (b = 0; b < 4; b++)
+                crc_length = (crc_length << 8) | stk_get_char();
+            read_address = address.word << 1;
+            if (stk_get_char() == STK_CRC_EOP) {
+                stk_put_char(STK_INSYNC);
+                crc_length = flash_crc32(read_address, crc_length);
+                // The CRC is sent little endian
+                for (b = 0; b < 4; b++) {
+                    stk_put_char(crc_length);
+                    crc_length >>= 8;
                 }
                 stk_put_char(STK_OK);
             }
+            else {
+                ++stk_errors;
+            }
             *GREEN_LED_PORT &= ~(1 << GREEN_LED_PIN);
         }
+#endif
         // Read signature bytes
         else if (ch == STK_READ_SIGN) {
             if (stk_get_char() == STK_CRC_EOP) {
@@ -617,9 +1413,14 @@ static void bootload_from_stk(void)
             stk_get_n_char(5);
             stk_nothing_response();
         }
-        // Universal command (ignored)
+        // Universal command (ignored, except for Load extended address)
         else if (ch == STK_UNIVERSAL) {
-            stk_get_n_char(4);
+            ch2 = stk_get_char();
+            stk_get_char();
+            ch = stk_get_char();
+            stk_get_char();
+            if (ch2 == STK_LOAD_EXTENDED_ADDRESS)
+                address.byte[2] = ch;
             stk_byte_response(0x00);
         }
         // Other commands are either invalid or ignored
@@ -636,58 +1437,497 @@ static bool add_error(uint8_t* count, uint8_t max_count) {
         return false;
     else {
         *count += 1;
-        _delay_ms(2000);
+        WAIT_MS(2000);
         return true;
     }
 }
 
-// Move an incomplete HEX line to the beginning of the buffer
-static void download_append_leftover(void) {
-    uint8_t* data = hex_buffer + hex_chunk.index;
-    uint8_t length = hex_chunk.size - hex_chunk.index;
-
+#ifdef UDP_PAGE_CAROUSEL
+/*
+ * Check a carousel packet held in the HEX buffer and decode its page to the
+ * binary buffer. Return the index of the page, or -1 if the packet is
+ * corrupted or belongs to another image.
+ */
+static int16_t carousel_check_packet(void)
+{
+    uint8_t header[4];
+    uint16_t count;
+    uint16_t crc;
+    uint16_t page;
     uint8_t i;
-    for (i = 0; i < length; i++) {
-        hex_buffer[i] = data[i];
+
+    // The header line gives the page index in the address field, then the
+    // number of pages and the CRC-16 of the image
+    if (!carousel_decode_line(hex_buffer, header, 4)
+        || carousel.record[3] != CAROUSEL_RECORD_TYPE)
+        return -1;
+    count = (header[0] << 8) | header[1];
+    crc = (header[2] << 8) | header[3];
+    if (carousel.count == 0) {
+        if (count == 0 || count > CAROUSEL_MAX_PAGES)
+            return -1;
+        carousel.count = count;
+        carousel.crc = crc;
     }
-    hex_buffer[i] = 0x00;
-    hex_chunk.index = i;
+    else if (count != carousel.count || crc != carousel.crc)
+        return -1;
+    page = (carousel.record[1] << 8) | carousel.record[2];
+    if (page >= carousel.count)
+        return -1;
+    // Then come the data lines, as in the packed HEX file
+    for (i = 0; i < 2*FLASH_PAGE_SIZE/PACKED_RECORD_SIZE; i++) {
+        if (!carousel_decode_line(
+                hex_buffer + CAROUSEL_HEADER_SIZE + i*PACKED_LINE_SIZE,
+                bin_buffer + i*PACKED_RECORD_SIZE, PACKED_RECORD_SIZE)
+            || carousel.record[3] != 0x00)
+            return -1;
+    }
+    return page;
 }
 
-/* Download the next HEX page and extract its binary content */
-static bool download_get_chunk(void)
+/* Check that the server has the image broadcast by the carousel */
+static bool carousel_check_image(void)
 {
-    return http_send(&request_get_chunk, &download_parse_chunk);
+    // The distributor and the server must agree on the packed layout, and on
+    // the CRC of the image so that no page of another image is written
+    if (hex_program_size == PACKED_HEADER_SIZE + PACKED_FOOTER_SIZE
+        + (uint32_t)carousel.count*PACKED_PAGE_SIZE
+#ifdef USE_UPDATE_MAILBOX
+        && carousel.crc == mailbox.checksum
+#else
+        && manifest.verify && carousel.crc == manifest.checksum
+#endif
+        ) {
+        hex_chunk.packed = true;
+        return true;
+    }
+    carousel.count = 0;
+    return false;
 }
 
-/* Get the location of the HEX file */
-static bool download_get_path(void)
+/*
+ * Decode a line of a carousel packet, with the expected number of data bytes
+ * The count, address and type fields are kept in carousel.record.
+ */
+static bool carousel_decode_line(const uint8_t* source, uint8_t* dest,
+    uint8_t count)
 {
-    if (!http_send(&request_get_status, 0))
-        return false;
-    if (!wifly_find_string(PATH_JSON_PREFIX))
+    int16_t value;
+    uint8_t i;
+
+    if (source[0] != ':')
         return false;
-    if (!download_parse_path())
+    line_checksum = 0;
+    for (i = 0; i < 4; i++) {
+        value = ihex_parse_byte(source + 1 + 2*i);
+        if (value < 0)
+            return false;
+        carousel.record[i] = value;
+    }
+    if (carousel.record[0] != count)
         return false;
-    else {
-        PROGRAM_PATH = path_buffer;
-        return true;
+    source += 9;
+    // The checksum byte follows the data
+    for (i = 0; i <= count; i++) {
+        value = ihex_parse_byte(source + 2*i);
+        if (value < 0)
+            return false;
+        if (i < count)
+            dest[i] = value;
     }
+    return line_checksum == 0;
 }
 
-/* Poll the HTTP server to get the size of the HEX file */
-static bool download_get_size(void)
+/* Check if a page was received from the carousel */
+static bool carousel_has_page(uint16_t page)
 {
-    return http_send(&request_get_size, &download_parse_size);
+    return carousel.received[page >> 3] & (1 << (page & 0x07));
 }
 
-/* Send a request to check if a new program is available */
-static bool download_get_status(void)
+#ifdef MULTI_RANGE_REQUESTS
+/*
+ * Copy the parts of a multipart/byteranges response to the HEX buffer, and
+ * list the pages they hold so that each one is written at its own address
+ */
+static bool carousel_parse_parts(void)
+{
+    uint8_t token[HTTP_TOKEN_SIZE];
+    uint32_t start;
+    uint32_t stop;
+    uint16_t length;
+    uint16_t size = 0;
+    uint16_t page;
+    uint16_t i;
+    uint8_t ch;
+
+    if (!http.body || !http.multipart)
+        return false;
+    // Each part starts with a boundary line, the last boundary being
+    // followed by the end of the body
+    while (wifly_find_string("--")) {
+        if (http_read_token(token, '\r') != '\r' || wifly_get_char() != '\n')
+            break;
+        start = 0;
+        stop = 0;
+        do {
+            ch = http_read_token(token, ':');
+            if (ch == 0x00 || (ch == '\r' && token[0] == 0x00))
+                break;
+            if (ch != ':')
+                return false;
+            // "Content-Range: bytes <start>-<stop>/<size>"
+            if (http_token_is(token, "content-range")) {
+                ch = http_read_number(&start, '-');
+                if (ch == '-')
+                    ch = http_read_number(&stop, '/');
+                if (ch == '/')
+                    ch = http_read_token(token, '\r');
+            }
+            else
+                ch = http_read_token(token, '\r');
+            if (ch != '\r' || wifly_get_char() != '\n')
+                return false;
+        } while (1);
+        if (ch == 0x00)
+            break;
+        if (wifly_get_char() != '\n')
+            return false;
+        // Parts hold whole pages of the packed layout, the last one possibly
+        // followed by the End Of File line
+        if (start < PACKED_HEADER_SIZE || stop < start
+            || (start - PACKED_HEADER_SIZE) % PACKED_PAGE_SIZE != 0
+            || stop - start >= HEX_BUFFER_SIZE - size)
+            return false;
+        length = stop - start + 1;
+        if (length % PACKED_PAGE_SIZE != 0
+            && (length % PACKED_PAGE_SIZE != PACKED_FOOTER_SIZE
+            || stop + 1 != hex_program_size))
+            return false;
+        for (i = 0; i < length; i++) {
+            ch = wifly_get_char();
+            if (ch == 0x00)
+                return false;
+            hex_buffer[size++] = ch;
+        }
+        page = (start - PACKED_HEADER_SIZE) / PACKED_PAGE_SIZE;
+        for (; length >= PACKED_PAGE_SIZE; length -= PACKED_PAGE_SIZE) {
+            if (carousel.pages == CAROUSEL_CHUNK_PAGES)
+                return false;
+            carousel.chunk[carousel.pages++] = page++;
+        }
+    }
+#ifdef WIFLY_FLOW_CONTROL
+    // The HEX buffer is full, hold any further data in the WiFly
+    *CTS_PORT |= (1 << CTS_PIN);
+#endif
+    // The pages must come in order, from the first one requested, without
+    // leaving out any page missed by the carousel
+    page = bin_page.address / FLASH_PAGE_SIZE;
+    for (i = 0; i < carousel.pages; page++) {
+        if (page >= carousel.count)
+            return false;
+        if (page == carousel.chunk[i])
+            ++i;
+        else if (i == 0 || !carousel_has_page(page))
+            return false;
+    }
+    if (carousel.pages == 0)
+        return false;
+    // Add a terminating null character
+    hex_chunk.size = size;
+    hex_buffer[size] = 0x00;
+    carousel.next = 1;
+    TELEMETRY_PEAK(PEAK_HEX_BUFFER, size);
+    return true;
+}
+
+/*
+ * Append the next runs of pages missed by the carousel to the Range field,
+ * as long as the response fits in the HEX buffer
+ */
+static void carousel_put_ranges(void)
+{
+    uint16_t size = hex_chunk.file_stop + 1 - hex_chunk.file_start;
+    uint16_t page;
+
+    carousel.ranges = 1;
+    // A corrupted line is requested again alone
+    if (carousel.count == 0 || carousel.single_range || bin_page.index != 0)
+        return;
+    page = (hex_chunk.file_stop + 1 - PACKED_HEADER_SIZE) / PACKED_PAGE_SIZE;
+    while (page < carousel.count && size + PACKED_PAGE_SIZE <= HEX_BUFFER_SIZE) {
+        if (carousel_has_page(page)) {
+            ++page;
+            continue;
+        }
+        wifly_put_char(',');
+        wifly_put_long(PACKED_HEADER_SIZE + (uint32_t)page*PACKED_PAGE_SIZE);
+        wifly_put_char('-');
+        while (page < carousel.count && !carousel_has_page(page)
+            && size + PACKED_PAGE_SIZE <= HEX_BUFFER_SIZE) {
+            size += PACKED_PAGE_SIZE;
+            ++page;
+        }
+        wifly_put_long(PACKED_HEADER_SIZE - 1
+            + (uint32_t)page*PACKED_PAGE_SIZE);
+        ++carousel.ranges;
+    }
+}
+#endif
+
+/* Read the next carousel packet to the HEX buffer, false on a UART timeout */
+static bool carousel_read_packet(void)
+{
+    uint16_t i;
+    uint8_t ch;
+
+    // Packets are made of text lines, and start with the header line
+    do {
+        ch = wifly_get_char();
+        if (ch == 0x00)
+            return false;
+    } while (ch != ':');
+    hex_buffer[0] = ch;
+    for (i = 1; i < CAROUSEL_PACKET_SIZE; i++) {
+        hex_buffer[i] = wifly_get_char();
+        if (hex_buffer[i] == 0x00)
+            return false;
+    }
+    TELEMETRY_PEAK(PEAK_HEX_BUFFER, CAROUSEL_PACKET_SIZE);
+    return true;
+}
+
+/*
+ * Write the pages broadcast by a distributor on the LAN, until the carousel
+ * has gone round once or stops bringing new pages. The server must have
+ * confirmed the update first, so that nothing is written for another image.
+ */
+static uint8_t carousel_receive(void)
+{
+    uint32_t deadline;
+    int16_t first = -1;
+    int16_t page;
+    uint16_t missing = 0;
+    uint8_t i;
+
+    TELEMETRY_PHASE(TIME_JOIN);
+    // Only the broadcast must reach UART1
+    wifly_close_socket();
+    // With the update mailbox, no request has joined the access point yet
+    if (!wifly_check_wlan()) {
+        wifly_enter_command_mode();
+        wifly_join_wlan();
+        for (i = 0; !wifly_check_wlan(); i++) {
+            if (i == MAX_WLAN_ERRORS)
+                return CAROUSEL_ABSENT;
+        }
+    }
+    if (wifly.command_mode) {
+        // Data from the network only reaches UART1 outside of command mode
+        wifly_put_string("exit\r");
+        wifly_find_string("EXIT");
+        wifly.command_mode = false;
+    }
+    // The module doesn't need another reset to open the socket
+    if (wifly.state == RESETTING)
+        wifly.state = SETTING_HOST;
+
+    TELEMETRY_PHASE(TIME_CHUNKS);
+    deadline = timer_read() + CAROUSEL_TIMEOUT;
+    while (!timer_expired(deadline)) {
+        if (!carousel_read_packet()) {
+            // Nobody broadcasts on the LAN
+            if (first < 0)
+                break;
+            continue;
+        }
+        page = carousel_check_packet();
+        if (page < 0)
+            continue;
+        if (first < 0) {
+            // Ignore the carousel if it broadcasts another image
+            if (!carousel_check_image())
+                return CAROUSEL_ABSENT;
+            // Nothing to do if the application is already the same image
+            if (flash_crc16(0, (uint32_t)carousel.count*2*FLASH_PAGE_SIZE)
+                == carousel.crc) {
+                bin_page.address = (uint32_t)carousel.count*FLASH_PAGE_SIZE;
+                return CAROUSEL_INSTALLED;
+            }
+            first = page;
+            missing = carousel.count;
+        }
+        else if (page == first)
+            break;
+        if (carousel_has_page(page))
+            continue;
+        TELEMETRY_PHASE(TIME_FLASH);
+        TELEMETRY_COUNT(COUNT_PAGES);
+        length.word = 2*FLASH_PAGE_SIZE;
+        address.word = (uint32_t)page*FLASH_PAGE_SIZE;
+        write_bin_page();
+        TRACE(TRACE_PAGE_WRITTEN, page);
+        TELEMETRY_PHASE(TIME_CHUNKS);
+        carousel.received[page >> 3] |= (1 << (page & 0x07));
+        deadline = timer_read() + CAROUSEL_TIMEOUT;
+        if (--missing == 0) {
+            bin_page.address = (uint32_t)carousel.count*FLASH_PAGE_SIZE;
+            return CAROUSEL_COMPLETE;
+        }
+    }
+    if (first < 0) {
+        carousel.count = 0;
+        return CAROUSEL_ABSENT;
+    }
+    return CAROUSEL_PARTIAL;
+}
+
+/*
+ * Move the download to the next page missed by the carousel, and find where
+ * the run of missed pages stops
+ */
+static void carousel_skip_pages(void)
+{
+    uint16_t page;
+
+    // A corrupted line is requested again from the middle of its page
+    if (carousel.count == 0 || bin_page.index != 0)
+        return;
+    page = bin_page.address / FLASH_PAGE_SIZE;
+    while (page < carousel.count && carousel_has_page(page))
+        ++page;
+    bin_page.address = (uint32_t)page*FLASH_PAGE_SIZE;
+    if (page == carousel.count) {
+        // The rest of the image came from the carousel, so the download ends
+        // on a page boundary with an empty binary page: EXITING must not
+        // write it, since write_bin_page can't program 0 bytes
+        hex_chunk.file_start = hex_program_size;
+        return;
+    }
+    hex_chunk.file_start = PACKED_HEADER_SIZE + (uint32_t)page*PACKED_PAGE_SIZE;
+    while (page < carousel.count && !carousel_has_page(page))
+        ++page;
+    carousel.stop = PACKED_HEADER_SIZE - 1 + (uint32_t)page*PACKED_PAGE_SIZE;
+    // The last run takes the End Of File line along
+    if (page == carousel.count)
+        carousel.stop += PACKED_FOOTER_SIZE;
+}
+#endif
+
+#if defined(CACHE_WIFLY_CONFIGURATION) || defined(RESUME_INTERRUPTED_DOWNLOAD)
+/* Update a 16-bit djb2 hash with the characters of a string */
+static uint16_t hash_string(uint16_t hash, const char* source)
+{
+    uint8_t index = 0;
+    while (source[index] != 0x00)
+        hash = (hash << 5) + hash + source[index++];
+    return hash;
+}
+#endif
+
+// Move an incomplete HEX line to the beginning of the buffer
+static void download_append_leftover(void) {
+    uint8_t* data = hex_buffer + hex_chunk.index;
+    uint8_t length = hex_chunk.size - hex_chunk.index;
+
+    uint8_t i;
+    for (i = 0; i < length; i++) {
+        hex_buffer[i] = data[i];
+    }
+    hex_buffer[i] = 0x00;
+    hex_chunk.index = i;
+}
+
+#if defined(USE_UPDATE_MANIFEST) \
+    && (defined(CLEAR_STATUS_AFTER_DOWNLOAD) || defined(THROTTLE_UPDATE_CHECKS))
+/* Check the image written to Flash against the CRC of the manifest */
+static bool download_check_image(void)
+{
+#ifdef BACKGROUND_TASKS
+    // The last page written must be readable
+    write_bin_page_finish();
+#endif
+    if (!manifest.verify)
+        return true;
+    return flash_crc16(0, ((uint32_t)bin_page.address << 1) + bin_page.index)
+        == manifest.checksum;
+}
+#endif
+
+#ifdef PACKED_HEX_FAST_PATH
+/* Check if the HEX file starts with the marker of the packed layout */
+static bool download_check_packed(void)
 {
-    if (!http_send(&request_get_status, 0))
+    uint8_t i;
+
+    for (i = 0; PACKED_HEX_MARKER[i] != 0x00; i++) {
+        if (hex_buffer[i] != PACKED_HEX_MARKER[i])
+            return false;
+    }
+    return true;
+}
+#endif
+
+/* Download the next HEX page and extract its binary content */
+static bool download_get_chunk(void)
+{
+    return http_send(&request_get_chunk, &download_parse_chunk);
+}
+
+#ifdef USE_UPDATE_MANIFEST
+/* Get the status, the location and the size of the HEX file at once */
+static bool download_get_manifest(void)
+{
+    if (!http_send(&request_get_manifest, &download_parse_manifest))
+        return false;
+#ifdef RESUME_INTERRUPTED_DOWNLOAD
+    // The server withdrew the update whose download the journal describes
+    if (!download.found)
+        journal_clear();
+#endif
+    if (!download.found || PROGRAM_PATH == 0 || hex_program_size == 0)
         return false;
     else
-        return wifly_find_string(CHECK_STATUS_EXPECTED_RESPONSE);
+        return true;
+}
+#endif
+
+/* Get the location of the HEX file */
+static bool download_get_path(void)
+{
+    if (!http_send(&request_get_status, &download_parse_location))
+        return false;
+    if (!download.found) {
+#ifdef RESUME_INTERRUPTED_DOWNLOAD
+        journal_clear();
+#endif
+        return false;
+    }
+    else {
+        PROGRAM_PATH = path_buffer;
+        return true;
+    }
+}
+
+#if !defined(USE_UPDATE_MANIFEST) && !defined(USE_UPDATE_MAILBOX)
+/* Poll the HTTP server to get the size of the HEX file */
+static bool download_get_size(void)
+{
+    return http_send(&request_get_size, &download_parse_size);
+}
+#endif
+
+/* Send a request to check if a new program is available */
+static bool download_get_status(void)
+{
+    if (!http_send(&request_get_status, &download_parse_status))
+        return false;
+#ifdef RESUME_INTERRUPTED_DOWNLOAD
+    // The server withdrew the update whose download the journal describes
+    if (!download.found)
+        journal_clear();
+#endif
+    return download.found;
 }
 
 /* Store the incoming data into the HEX page buffer */
@@ -695,25 +1935,135 @@ static bool download_parse_chunk(void)
 {
     uint32_t i;
     uint8_t* dest;
-    // Skip HTTP status and header
-    if (!wifly_find_string("\r\n\r\n"))
+#ifdef MULTI_RANGE_REQUESTS
+    carousel.pages = 0;
+    if (carousel.ranges > 1) {
+        if (carousel_parse_parts())
+            return true;
+        // The server doesn't serve several ranges at once, or not in a way
+        // the bootloader understands, so ask for one range at a time from now on
+        carousel.single_range = true;
+        carousel.pages = 0;
+        return false;
+    }
+#endif
+    hex_chunk.size = hex_chunk.file_stop - hex_chunk.file_start + 1;
+    // A server that ignores the Range field sends the whole file
+    if (!http.body || http.remaining != hex_chunk.size)
         return false;
     else {
         // Download HTTP response body
         dest = hex_buffer + hex_chunk.index;
-        hex_chunk.size = hex_chunk.file_stop - hex_chunk.file_start + 1;
         for (i = 0; i < hex_chunk.size; i++) {
             dest[i] = wifly_get_char();
             if (dest[i] == 0x00) {
                 return false;
             }
         }
+#ifdef WIFLY_FLOW_CONTROL
+        // The HEX buffer is full, hold any further data in the WiFly
+        *CTS_PORT |= (1 << CTS_PIN);
+#endif
         // Add a terminating null character
         dest[i] = 0x00;
+        TELEMETRY_PEAK(PEAK_HEX_BUFFER, hex_chunk.index + hex_chunk.size);
         return true;
     }
 }
 
+/* Find the location of the HEX file in the response to the status call */
+static bool download_parse_location(void)
+{
+    download.found = wifly_find_string(PATH_JSON_PREFIX)
+        && download_parse_path();
+    return true;
+}
+
+#ifdef USE_UPDATE_MANIFEST
+/*
+ * Parse the update manifest, a flat JSON object read in a single pass:
+ * {"update":1,"path":"/program.hex","size":84388,"crc":4660,"format":"hex"}
+ * Only "update" is mandatory, the other keys being needed when an update is
+ * available. The format is either "hex" or "packed" (see tools/hex_pack).
+ */
+static bool download_parse_manifest(void)
+{
+    uint8_t key[HTTP_TOKEN_SIZE];
+    uint8_t value[HTTP_TOKEN_SIZE];
+    bool supported = true;
+    uint32_t number;
+    uint8_t ch;
+
+    download.found = false;
+    manifest.verify = false;
+    if (!wifly_find_string("{"))
+        return false;
+    do {
+        // Find the next key, skipping the separators
+        do {
+            ch = wifly_get_char();
+            if (ch == 0x00)
+                return false;
+        } while (ch == ' ' || ch == ',' || ch == '\r' || ch == '\n');
+        if (ch == '}')
+            break;
+        if (ch != '\"' || http_read_token(key, '\"') != '\"')
+            return false;
+        do {
+            ch = wifly_get_char();
+            if (ch == 0x00)
+                return false;
+        } while (ch == ' ' || ch == ':');
+        if (ch == '\"') {
+            // String values
+            if (http_token_is(key, "path")) {
+                if (!download_parse_path())
+                    return false;
+                PROGRAM_PATH = path_buffer;
+            }
+            else {
+                if (http_read_token(value, '\"') != '\"')
+                    return false;
+                if (http_token_is(key, "format")) {
+#ifdef PACKED_HEX_FAST_PATH
+                    // Align the first chunk on the pages of the packed layout
+                    hex_chunk.packed = http_token_is(value, "packed");
+#endif
+                    // The bootloader only reads HEX files
+                    if (!http_token_is(value, "hex")
+                        && !http_token_is(value, "packed"))
+                        supported = false;
+                }
+            }
+        }
+        else {
+            // Numbers and booleans, the character that follows being a
+            // separator
+            number = (ch == 't');
+            while ((ch >= '0' && ch <= '9') || (ch >= 'a' && ch <= 'z')) {
+                if (ch <= '9')
+                    number = 10*number + ch - '0';
+                ch = wifly_get_char();
+            }
+            if (http_token_is(key, "update"))
+                download.found = (number != 0);
+            else if (http_token_is(key, "size"))
+                hex_program_size = number;
+            else if (http_token_is(key, "crc")) {
+                manifest.checksum = number;
+                manifest.verify = true;
+            }
+            if (ch == '}')
+                break;
+        }
+    } while (1);
+    // An update in another format is ignored
+    if (!supported)
+        download.found = false;
+    return true;
+}
+#endif
+
 /* Parse the value associated to the "path" key in the JSON response */
 static bool download_parse_path(void)
 {
@@ -737,45 +2087,23 @@ static bool download_parse_path(void)
     return true;
 }
 
-/* Parse the Content-Length field from the incoming HTTP header */
+#if !defined(USE_UPDATE_MANIFEST) && !defined(USE_UPDATE_MAILBOX)
+/* Get the size of the HEX file from the Content-Length field */
 static bool download_parse_size(void)
 {
-    uint8_t i, nb_digits;
-    uint32_t result;
-    uint8_t ch;
-    uint8_t buffer[16];
-
-    // Find the digits in the HTTP input stream
-    if (!wifly_find_string("Content-Length: ")) {
-        return false;
-    }
-    else {
-        i = 0;
-        do {
-            ch = wifly_get_char();
-            if (ch == 0)
-                return false;
-            else {
-                buffer[i++] = ch;
-            }
-        } while (ch != '\r');
-        buffer[i] = 0x00;
-        nb_digits = i - 1;
-    }
+    hex_program_size = http.remaining;
+    // The response to a HEAD request has no body
+    http.remaining = 0;
+    return http.body && hex_program_size > 0;
+}
+#endif
 
-    // Compute the value represented by these digits
-    result = 0;
-    for (i = 0; i < nb_digits; i++) {
-        ch = buffer[i];
-        if (ch < '0' || ch > '9')
-            return false;
-        else {
-            result *= 10;
-            result += (uint32_t)(ch - '0');
-        }
-    }
-    hex_program_size = result;
-    return (hex_program_size > 0);
+/* Check if the response to the status call announces an update */
+static bool download_parse_status(void)
+{
+    // Not finding the expected response isn't an HTTP error
+    download.found = wifly_find_string(CHECK_STATUS_EXPECTED_RESPONSE);
+    return true;
 }
 
 /* Send a request to confirm that the program was successfully downloaded */
@@ -795,32 +2123,409 @@ static void eeprom_read_id(void)
     );
 }
 
+#ifdef RESUME_INTERRUPTED_DOWNLOAD
+/* Invalidate the download journal */
+static void journal_clear(void)
+{
+    eeprom_update_dword((uint32_t*)JOURNAL_EEPROM_ADDRESS, 0);
+}
+
+/* Record the last committed page every JOURNAL_PAGE_INTERVAL pages */
+static void journal_commit(void)
+{
+    if (++journal.pages < JOURNAL_PAGE_INTERVAL)
+        return;
+    journal.pages = 0;
+#ifdef BACKGROUND_TASKS
+    // The EEPROM can't be written while the Page Write is in progress
+    write_bin_page_finish();
+#endif
+    // Offset of the current HEX line within the file
+    journal.entry.line_offset = hex_chunk.file_stop + 1 - hex_chunk.size
+        + hex_chunk.line;
+    // Number of data bytes of the current line that are already in Flash,
+    // the byte count being still readable in the header of the line
+    journal.entry.skip = ihex_parse_byte(hex_buffer + hex_chunk.line + 1)
+        - line_byte_count;
+    journal.entry.page = bin_page.address/FLASH_PAGE_SIZE;
+    journal_write_entry();
+}
+
+/* Compute a 16-bit hash of the HEX file location and of its content */
+static uint16_t journal_hash_image(void)
+{
+#if defined(USE_UPDATE_MAILBOX)
+    return hash_string(mailbox.checksum, PROGRAM_PATH);
+#elif defined(USE_UPDATE_MANIFEST)
+    // Without a CRC in the manifest, only the size tells the images apart
+    return hash_string(manifest.verify ? manifest.checksum : 5381,
+        PROGRAM_PATH);
+#else
+    // The ETag sent along with the size of the HEX file changes with it
+    return hash_string(http.etag, PROGRAM_PATH);
+#endif
+}
+
+/*
+ * Load the last journal entry if it describes the image hosted on the server,
+ * otherwise start a new journal for this image
+ */
+static void journal_restore(void)
+{
+    struct journal_header_struct header;
+    struct journal_entry_struct* const entries =
+        (struct journal_entry_struct*)(JOURNAL_EEPROM_ADDRESS + sizeof(header));
+    uint8_t sequence;
+
+    // The most recent entry is the last one of the sequence
+    eeprom_read_block(&journal.entry, entries, sizeof(journal.entry));
+    for (journal.slot = 0; journal.slot < JOURNAL_SLOTS - 1; journal.slot++) {
+        sequence = journal.entry.sequence;
+        eeprom_read_block(&journal.entry, entries + journal.slot + 1,
+            sizeof(journal.entry));
+        if (journal.entry.sequence != (uint8_t)(sequence + 1)) {
+            eeprom_read_block(&journal.entry, entries + journal.slot,
+                sizeof(journal.entry));
+            break;
+        }
+    }
+
+    eeprom_read_block(&header, JOURNAL_EEPROM_ADDRESS, sizeof(header));
+    if (header.size == hex_program_size
+        && header.image_hash == journal_hash_image()) {
+        hex_chunk.file_start = journal.entry.line_offset;
+        bin_page.address = (uint32_t)journal.entry.page*FLASH_PAGE_SIZE;
+        journal.skip = journal.entry.skip;
+    }
+    else {
+        // Start a new journal from the beginning of the image. The entry is
+        // written before the header so that a power loss in between cannot
+        // pair the new image with the progress of the previous one.
+        journal.entry.line_offset = 0;
+        journal.entry.page = 0;
+        journal.entry.skip = 0;
+        journal_write_entry();
+        header.size = hex_program_size;
+        header.image_hash = journal_hash_image();
+        eeprom_update_block(&header, JOURNAL_EEPROM_ADDRESS, sizeof(header));
+    }
+}
+
+/* Skip the data bytes of the first resumed line that were already written */
+static void journal_skip(void)
+{
+    hex_chunk.index += journal.skip;
+    line_byte_count -= journal.skip;
+    journal.skip = 0;
+}
+
+/* Write the journal entry to the next slot of the ring */
+static void journal_write_entry(void)
+{
+    struct journal_entry_struct* const entries =
+        (struct journal_entry_struct*)(JOURNAL_EEPROM_ADDRESS
+            + sizeof(struct journal_header_struct));
+
+    if (++journal.slot == JOURNAL_SLOTS)
+        journal.slot = 0;
+    ++journal.entry.sequence;
+    // Write the sequence number last so that a torn entry is never seen as
+    // the most recent one
+    eeprom_update_block(&journal.entry.line_offset,
+        &entries[journal.slot].line_offset,
+        sizeof(journal.entry) - sizeof(journal.entry.sequence));
+    eeprom_update_byte(&entries[journal.slot].sequence,
+        journal.entry.sequence);
+}
+#endif
+
+#if defined(EXPORT_FLASH_SERVICES) || defined(USE_UPDATE_MAILBOX) \
+    || defined(UDP_PAGE_CAROUSEL) \
+    || (defined(USE_UPDATE_MANIFEST) && (defined(CLEAR_STATUS_AFTER_DOWNLOAD) \
+    || defined(THROTTLE_UPDATE_CHECKS)))
+/* Compute the CRC-16 of a block of Flash memory */
+static uint16_t flash_crc16(uint32_t address, uint32_t size)
+{
+    uint16_t crc = 0xFFFF;
+
+    while (size--)
+        crc = _crc16_update(crc, pgm_read_byte_far(address++));
+    return crc;
+}
+#endif
+
+#ifdef STK_CRC_EXTENSION
+/* CRC-32 of a range of the Flash memory, read a word at a time */
+static uint32_t flash_crc32(uint32_t address, uint32_t size)
+{
+    uint32_t crc = 0xFFFFFFFF;
+    uint16_t word;
+    uint8_t bits;
+
+    while (size != 0) {
+        word = pgm_read_word_far(address);
+        address += 2;
+        // The low byte comes first, and only that one ends an odd range
+        bits = (size == 1) ? 8 : 16;
+        size -= bits >> 3;
+        do {
+            if ((crc ^ word) & 0x01)
+                crc = (crc >> 1) ^ CRC32_POLYNOMIAL;
+            else
+                crc >>= 1;
+            word >>= 1;
+        } while (--bits != 0);
+    }
+    return ~crc;
+}
+#endif
+
+#ifdef EXPORT_FLASH_SERVICES
+/*
+ * Erase the Flash page at a byte address, unless it belongs to the bootloader.
+ * This function may be called by the application, so it only uses the stack.
+ */
+static bool flash_erase_page(uint32_t address)
+{
+    uint8_t sreg = SREG;
+
+    if (address >= BOOTADDRESS || (address & (2*FLASH_PAGE_SIZE - 1)))
+        return false;
+    // The interrupt vectors can't be read while the RWW section is busy
+    cli();
+    eeprom_busy_wait();
+    boot_page_erase_extended(address);
+    boot_spm_busy_wait();
+    boot_rww_enable();
+    SREG = sreg;
+    return true;
+}
+
+/*
+ * Copy the image staged in the upper half of the Flash memory to the
+ * application section if its CRC matches the descriptor left by the
+ * application
+ */
+static void flash_install_staged_image(void)
+{
+    struct staged_image_struct image;
+    uint32_t offset;
+    uint16_t b;
+
+    eeprom_read_block(&image, STAGED_IMAGE_EEPROM_ADDRESS, sizeof(image));
+    if (image.magic != STAGED_IMAGE_MAGIC)
+        return;
+    if (image.size <= BOOTADDRESS - STAGING_ADDRESS
+        && flash_crc16(STAGING_ADDRESS, image.size) == image.crc) {
+        for (offset = 0; offset < image.size; offset += 2*FLASH_PAGE_SIZE) {
+            for (b = 0; b < 2*FLASH_PAGE_SIZE; b++)
+                bin_buffer[b] = pgm_read_byte_far(STAGING_ADDRESS + offset + b);
+            flash_write_page(offset, bin_buffer);
+        }
+    }
+    // Clear the magic value last, so that a copy interrupted by a power loss
+    // starts over on the next reset
+    eeprom_update_word(STAGED_IMAGE_EEPROM_ADDRESS + 3, 0xFFFF);
+}
+
+/*
+ * Jump table placed at a fixed address at the end of the bootloader section.
+ * It starts with the version (1) and the number of entries (3), followed by a
+ * JMP instruction to each service. The section isn't flagged as code, so that
+ * the linker relaxation can't shorten the instructions.
+ */
+asm(
+    ".section .flash_services,\"a\",@progbits\n"
+    ".global flash_services\n"
+    "flash_services:\n"
+    ".word 1\n"
+    ".word 3\n"
+    "jmp flash_erase_page\n"
+    "jmp flash_write_page\n"
+    "jmp flash_crc16\n"
+    ".previous\n"
+);
+
+/*
+ * Erase and program a full Flash page at a byte address, unless it belongs to
+ * the bootloader. This function may be called by the application, so it only
+ * uses the stack.
+ */
+static bool flash_write_page(uint32_t address, const uint8_t* data)
+{
+    uint8_t sreg = SREG;
+    uint16_t b;
+
+    if (!flash_erase_page(address))
+        return false;
+    cli();
+    for (b = 0; b < 2*FLASH_PAGE_SIZE; b += 2)
+        boot_page_fill_extended(address + b, data[b] | (data[b + 1] << 8));
+    boot_page_write_extended(address);
+    boot_spm_busy_wait();
+    boot_rww_enable();
+    SREG = sreg;
+    return true;
+}
+#endif
+
 /* Wait for a response from the server to the last HTTP request sent */
 static bool http_await_response(void)
 {
-    // Reset the Timer/Counter
-    TCNT3 = 0;
-    // Clear the Compare Match flag by writing a logical one to its location
-    TIFR3 |= (1 << HTTP_OCF);
-    // The flag is set again on compare match
-    while (!(TIFR3 & (1 << HTTP_OCF))) {
+#ifdef WIFLY_FLOW_CONTROL
+    // Let the WiFly send the response
+    *CTS_PORT &= ~(1 << CTS_PIN);
+#endif
+    uint32_t deadline = timer_read() + HTTP_TIMEOUT;
+
+    while (!timer_expired(deadline)) {
         if ((UCSR1A & (1 << RXC1))) {
         return true;
         }
+        TASKS_RUN();
     }
+    TRACE(TRACE_TIMEOUT, HTTP_TIMEOUT_SOURCE);
     return false;
 }
 
+/* Read the rest of the body, so that the next response starts the stream */
+static void http_drain(void)
+{
+    // Without a Content-Length, the end of the body is unknown and the socket
+    // is closed before the next request
+    if (http.body && !http.close) {
+        while (http.remaining != 0) {
+            if (wifly_get_char() == 0x00 && !http.body)
+                return;
+        }
+        http.framed = true;
+    }
+    http.body = false;
+}
+
+/* Read the header of an HTTP response up to the empty line */
+static bool http_parse_header(void)
+{
+    uint8_t token[HTTP_TOKEN_SIZE];
+    bool connection;
+    bool length = false;
+    uint8_t ch;
+
+    http.body = false;
+    http.close = false;
+    http.multipart = false;
+#ifdef RESUME_INTERRUPTED_DOWNLOAD
+    http.etag = 5381;
+#endif
+    // Skip the status line
+    if (!wifly_find_string("\r\n"))
+        return false;
+    do {
+        // Read the name of the field, an empty line ending the header
+        ch = http_read_token(token, ':');
+        if (ch == '\r' && token[0] == 0x00) {
+            if (wifly_get_char() != '\n')
+                return false;
+            // The body is counted from here
+            http.body = length;
+            return true;
+        }
+        if (ch != ':')
+            return false;
+        if (http_token_is(token, "content-length")) {
+            ch = http_read_number(&http.remaining, '\r');
+            length = true;
+        }
+#ifdef RESUME_INTERRUPTED_DOWNLOAD
+        else if (http_token_is(token, "etag")) {
+            // Hash the whole tag, which may be longer than a token
+            while ((ch = wifly_get_char()) != '\r' && ch != 0x00)
+                http.etag = (http.etag << 5) + http.etag + ch;
+        }
+#endif
+#ifdef MULTI_RANGE_REQUESTS
+        else if (http_token_is(token, "content-type")) {
+            // The parts of a multipart response have their own header
+            ch = http_read_token(token, '/');
+            http.multipart = http_token_is(token, "multipart");
+            if (ch == '/')
+                ch = http_read_token(token, '\r');
+        }
+#endif
+        else {
+            connection = http_token_is(token, "connection");
+            ch = http_read_token(token, '\r');
+            if (connection && http_token_is(token, "close"))
+                http.close = true;
+        }
+        if (ch != '\r' || wifly_get_char() != '\n')
+            return false;
+    } while (1);
+}
+
+/* Read a token ending with a decimal number, 0 if there is no number */
+static uint8_t http_read_number(uint32_t* number, uint8_t separator)
+{
+    uint8_t token[HTTP_TOKEN_SIZE];
+    uint8_t ch = http_read_token(token, separator);
+    uint8_t i;
+
+    // Start over after anything but a digit, such as the unit of a range
+    *number = 0;
+    for (i = 0; token[i] != 0x00; i++) {
+        if (token[i] < '0' || token[i] > '9')
+            *number = 0;
+        else
+            *number = 10*(*number) + token[i] - '0';
+    }
+    if (i == 0 || token[i - 1] < '0' || token[i - 1] > '9')
+        return 0x00;
+    return ch;
+}
+
+/* Read a lowercase token up to a separator or to the end of the line */
+static uint8_t http_read_token(uint8_t* token, uint8_t separator)
+{
+    uint8_t i = 0;
+    uint8_t ch;
+
+    do {
+        ch = wifly_get_char();
+        if (ch == 0x00 || ch == separator || ch == '\r')
+            break;
+        // Skip the spaces before a value and truncate long tokens
+        if ((ch != ' ' || i != 0) && i < HTTP_TOKEN_SIZE - 1)
+            token[i++] = ch | 0x20;
+    } while (1);
+    token[i] = 0x00;
+    return ch;
+}
+
 /* Send an HTTP request and process the response */
 static bool http_send(void (*request)(void), bool (*action)(void)) {
     do {
+        TRACE(TRACE_DOWNLOAD_STATE, download.state);
         if (download.state == CHECKING_SOCKET) {
-            if (wifly_connect_to_host())
+            // Keep using the socket as long as the responses were read up to
+            // their last byte
+            if (http.framed && (*GPIO6_PORT_INPUT & (1 << GPIO6_PIN)))
                 download.state = SENDING_REQUEST;
-            else
-                download.state = DOWNLOAD_CRITICAL_ERROR;
+            else {
+                if (!http.framed) {
+                    // Drop the socket along with the rest of the response
+                    wifly_close_socket();
+                    while (UCSR1A & (1 << RXC1))
+                        (void)UDR1;
+                    http.framed = true;
+                }
+                if (wifly_connect_to_host())
+                    download.state = SENDING_REQUEST;
+                else
+                    download.state = DOWNLOAD_CRITICAL_ERROR;
+            }
         }
         else if (download.state == SENDING_REQUEST) {
+            http.framed = false;
             (*request)();
             if (http_await_response())
                 download.state = RECEIVING_RESPONSE;
@@ -828,20 +2533,22 @@ static bool http_send(void (*request)(void), bool (*action)(void)) {
                 download.state = HTTP_ERROR;
         }
         else if (download.state == RECEIVING_RESPONSE) {
-            if (action == 0) {
-                download.state = CHECKING_SOCKET;
-                return true;
-            }
-            else if ((*action)()) {
+            if (http_parse_header() && (action == 0 || (*action)())) {
+                http_drain();
                 download.state = CHECKING_SOCKET;
                 return true;
             }
-            else
+            else {
+                http.body = false;
                 download.state = HTTP_ERROR;
+            }
         }
         else if (download.state == HTTP_ERROR) {
+            TELEMETRY_PHASE(TIME_RETRY);
+            TELEMETRY_COUNT(COUNT_HTTP_ERRORS);
+            // Retry on a new socket unless the response was read completely
             if (add_error(&download.errors.http, MAX_HTTP_ERRORS))
-                download.state = SENDING_REQUEST;
+                download.state = CHECKING_SOCKET;
             else
                 download.state = DOWNLOAD_CRITICAL_ERROR;
         }
@@ -858,39 +2565,84 @@ static bool http_send(void (*request)(void), bool (*action)(void)) {
     } while (1);
 }
 
-/* Check if the next HEX line is complete in the HEX buffer */
-static bool ihex_check_line(void)
+/* Check if a token matches a lowercase string */
+static bool http_token_is(const uint8_t* token, const char* name)
+{
+    while (*name != 0x00) {
+        if (*token++ != *name++)
+            return false;
+    }
+    return *token == 0x00;
+}
+
+/*
+ * Check that the next HEX line is complete in the HEX buffer and that its
+ * checksum is correct. The data bytes are decoded in place, right before the
+ * checksum, so that they are only parsed once.
+ */
+static uint8_t ihex_check_line(void)
 {
+    uint8_t* line = hex_buffer + hex_chunk.index;
+    int16_t value;
+    uint8_t record_type;
+    uint8_t i;
+
     // Make sure the HEX buffer contains at least:
     // - the start code (1 byte)
     // - the byte count (2 bytes)
     // - the address (4 bytes)
     // - the record type (2 bytes)
     if (hex_chunk.size < hex_chunk.index + 9)
-        return false;
+        return HEX_LINE_INCOMPLETE;
     // Check the start code
-    if (hex_buffer[hex_chunk.index] != ':')
-        return false;
+    if (line[0] != ':')
+        return HEX_LINE_INVALID;
     // Parse the byte count
-    line_byte_count = ihex_parse_byte(hex_buffer + hex_chunk.index + 1);
+    line_checksum = 0;
+    value = ihex_parse_byte(line + 1);
+    if (value < 0)
+        return HEX_LINE_INVALID;
+    line_byte_count = value;
     // Make sure the HEX buffer contains the rest of the line, including the
     // the CRC (2 bytes) and the "\r\n"
-    if (hex_chunk.size < hex_chunk.index + 9 + (line_byte_count << 1))
-        return false;
-    // Parse the record type
-    uint16_t record_type = ihex_parse_byte(hex_buffer + hex_chunk.index + 7);
-    // Place the index at the beginning of the data frame
-    hex_chunk.index += 9;
-    // Skip the data of Extended Segment Address records
-    if (record_type == 0x02) {
+    if (hex_chunk.size < hex_chunk.index + 13 + (line_byte_count << 1))
+        return HEX_LINE_INCOMPLETE;
+    // Parse the address and the record type
+    if (ihex_parse_byte(line + 3) < 0 || ihex_parse_byte(line + 5) < 0)
+        return HEX_LINE_INVALID;
+    value = ihex_parse_byte(line + 7);
+    if (value < 0)
+        return HEX_LINE_INVALID;
+    record_type = value;
+    // Decode the data from the end of the line, each byte being stored after
+    // the digits that are still to be read
+    line += 9;
+    for (i = line_byte_count; i > 0; i--) {
+        value = ihex_parse_byte(line + (i << 1) - 2);
+        if (value < 0)
+            return HEX_LINE_INVALID;
+        line[line_byte_count + i - 1] = value;
+    }
+    // The sum of all the bytes of the line, CRC included, must be 0
+    if (ihex_parse_byte(line + (line_byte_count << 1)) < 0
+        || line_checksum != 0)
+        return HEX_LINE_INVALID;
+    // Remember where the line starts
+    hex_chunk.line = hex_chunk.index;
+    // Place the index at the beginning of the decoded data
+    hex_chunk.index += 9 + line_byte_count;
+    // Skip the data of the records other than Data records (Extended
+    // Segment Address records above 64kB, Extended Linear Address records
+    // above 128kB, start address records)
+    if (record_type != 0x00) {
+        hex_chunk.index += line_byte_count;
         line_byte_count = 0;
-        hex_chunk.index += 4;
     }
-    return true;
+    return HEX_LINE_VALID;
 }
 
-/* Load one byte of binary content to the page buffer */
-static bool ihex_load_byte(void)
+/* Load the decoded bytes of the line to the page buffer, up to a full page */
+static bool ihex_load_bytes(void)
 {
     if (line_byte_count == 0) {
         // Skip the CRC and the "\r\n"
@@ -898,44 +2650,102 @@ static bool ihex_load_byte(void)
         return false;
     }
     else {
-        // Copy one byte of the HEX line content to the binary page buffer
-        bin_buffer[bin_page.index] =
-            ihex_parse_byte(hex_buffer + hex_chunk.index);
-        bin_page.index += 1;
-        hex_chunk.index += 2;
-        line_byte_count -= 1;
+        // Copy the decoded bytes of the HEX line to the binary page buffer
+        do {
+            bin_buffer[bin_page.index++] = hex_buffer[hex_chunk.index++];
+        } while (--line_byte_count != 0
+            && bin_page.index != 2*FLASH_PAGE_SIZE);
         return true;
     }
 }
 
-static uint8_t ihex_parse_byte(uint8_t* source)
+/* Decode two hexadecimal digits and add the byte to the line checksum */
+static int16_t ihex_parse_byte(const uint8_t* source)
+{
+    uint8_t high = source[0] - '0';
+    uint8_t low = source[1] - '0';
+
+    // Characters below '0' wrap around to the end of the range
+    if (high >= sizeof(IHEX_DIGITS) || low >= sizeof(IHEX_DIGITS))
+        return -1;
+    // The table lies in the bootloader section, above the reach of LPM
+    high = pgm_read_byte_far(pgm_get_far_address(IHEX_DIGITS) + high);
+    low = pgm_read_byte_far(pgm_get_far_address(IHEX_DIGITS) + low);
+    if ((high | low) & 0x80)
+        return -1;
+    low |= high << 4;
+    line_checksum += low;
+    return low;
+}
+
+#ifdef USE_UPDATE_MAILBOX
+/* Empty the update mailbox if the image written matches its checksum */
+static void mailbox_close(void)
+{
+#ifdef BACKGROUND_TASKS
+    // The last page written must be readable
+    write_bin_page_finish();
+#endif
+    if (flash_crc16(0, ((uint32_t)bin_page.address << 1) + bin_page.index)
+        == mailbox.checksum)
+        eeprom_update_dword((uint32_t*)MAILBOX_EEPROM_ADDRESS, 0xFFFFFFFF);
+}
+
+/* Get the location and the size of the HEX file from the update mailbox */
+static bool mailbox_read(void)
+{
+    eeprom_read_block(&mailbox, MAILBOX_EEPROM_ADDRESS, sizeof(mailbox));
+    // The mailbox is empty if it was erased or cleared
+    if (mailbox.size == 0 || mailbox.size == 0xFFFFFFFF)
+        return false;
+    eeprom_read_block(path_buffer, MAILBOX_EEPROM_ADDRESS + sizeof(mailbox),
+        MAILBOX_PATH_LENGTH);
+    path_buffer[MAILBOX_PATH_LENGTH - 1] = 0x00;
+    PROGRAM_PATH = path_buffer;
+    hex_program_size = mailbox.size;
+    return true;
+}
+#endif
+
+#ifdef MEASURE_RAM_USAGE
+/*
+ * Fill the free RAM with a known value before the C runtime sets up the
+ * stack, so that the deepest use of the stack can be found later on. The
+ * .init1 section is always kept by the linker, hence the condition.
+ */
+static void ram_paint_stack(void)
+{
+    asm volatile(
+    // Load the end of .bss to pointer register Z (R31:R30)
+    "ldi   r30,lo8(_end)    \n\t"
+    "ldi   r31,hi8(_end)    \n\t"
+    "ldi   r24,%0           \n\t"
+    "ldi   r25,hi8(__stack) \n\t"
+    // Paint up to the top of the RAM, included
+    "paint_loop:            \n\t"
+    "st    Z+,r24           \n\t"
+    "cpi   r30,lo8(__stack) \n\t"
+    "cpc   r31,r25          \n\t"
+    "brlo  paint_loop       \n\t"
+    "breq  paint_loop       \n\t"
+    :
+    : "M" (STACK_PAINT)
+    );
+}
+
+/* Measure the deepest use of the stack since the reset, in bytes */
+static uint16_t ram_stack_depth(void)
 {
-    uint8_t byte_value;
-    uint8_t* data;
-    uint8_t ch;
-
-    data = source;
-    // Convert first digit to first nibble
-    ch = *data++;
-    if (ch >= '0' && ch <= '9')
-        byte_value = ch - '0';
-    else if (ch >= 'A' && ch <= 'F')
-        byte_value = ch - 'A' + 10;
-    else {
-        return false;
-    }
-    byte_value <<= 4;
-    // Convert second digit to second nibble
-    ch = *data++;
-    if (ch >= '0' && ch <= '9')
-        byte_value += ch - '0';
-    else if (ch >= 'A' && ch <= 'F')
-        byte_value += ch - 'A' + 10;
-    else {
-        return false;
-    }
-    return byte_value;
+    extern uint8_t _end;
+    const uint8_t* bottom = &_end;
+
+    // Nothing lives between .bss and the stack, so the first byte that
+    // lost its paint was reached by the stack
+    while (bottom <= (const uint8_t*)RAMEND && *bottom == STACK_PAINT)
+        ++bottom;
+    return (const uint8_t*)RAMEND + 1 - bottom;
 }
+#endif
 
 /*
  * Send a partial GET request to the server in order to receive the next page
@@ -943,11 +2753,26 @@ static uint8_t ihex_parse_byte(uint8_t* source)
  */
 static void request_get_chunk(void)
 {
+    TELEMETRY_PHASE(TIME_CHUNKS);
     // Compute the position of the next program page within the HEX file
+#ifdef PACKED_HEX_FAST_PATH
+    // Stop on a Flash page boundary of the packed layout, so that each chunk
+    // holds whole lines and whole pages
+    if (hex_chunk.packed)
+        hex_chunk.file_stop = PACKED_HEADER_SIZE - 1
+            + (hex_chunk.file_start - PACKED_HEADER_SIZE + HEX_BUFFER_SIZE)
+            / PACKED_PAGE_SIZE * PACKED_PAGE_SIZE;
+    else
+#endif
     hex_chunk.file_stop =
         hex_chunk.file_start - hex_chunk.index+ HEX_BUFFER_SIZE - 1;
     if (hex_chunk.file_stop >= hex_program_size)
         hex_chunk.file_stop = hex_program_size - 1;
+#ifdef UDP_PAGE_CAROUSEL
+    // Stop before the next page received from the carousel
+    if (carousel.count != 0 && hex_chunk.file_stop > carousel.stop)
+        hex_chunk.file_stop = carousel.stop;
+#endif
     // Send HTTP GET range request
     wifly_put_string("GET ");
     wifly_put_string(PROGRAM_PATH);
@@ -956,25 +2781,45 @@ static void request_get_chunk(void)
     wifly_put_long(hex_chunk.file_start);
     wifly_put_string("-");
     wifly_put_long(hex_chunk.file_stop);
+#ifdef MULTI_RANGE_REQUESTS
+    // Ask for the next pages missed by the carousel in the same request
+    carousel_put_ranges();
+#endif
     wifly_put_string(
         "\r\n"
         "\r\n"
     );
 }
 
+#if !defined(USE_UPDATE_MANIFEST) && !defined(USE_UPDATE_MAILBOX)
 /* Send a HEAD request about the HEX file to the server */
 static void request_get_size(void)
 {
+    TELEMETRY_PHASE(TIME_HEAD);
     wifly_put_string("HEAD ");
     wifly_put_string(PROGRAM_PATH);
     wifly_put_string(HTTP_FIELDS);
     wifly_put_string("\r\n");
 
 }
+#endif
+
+#ifdef USE_UPDATE_MANIFEST
+/* Send a request for the manifest of the update */
+static void request_get_manifest(void)
+{
+    TELEMETRY_PHASE(TIME_STATUS);
+    wifly_put_string(MANIFEST_REQUEST);
+    wifly_put_string(device_id);
+    wifly_put_string(HTTP_FIELDS);
+    wifly_put_string("\r\n");
+}
+#endif
 
 /* Send a request to check if a new program is available */
 static void request_get_status(void)
 {
+    TELEMETRY_PHASE(TIME_STATUS);
     wifly_put_string(CHECK_STATUS_REQUEST);
     wifly_put_string(device_id);
     wifly_put_string(HTTP_FIELDS);
@@ -984,12 +2829,34 @@ static void request_get_status(void)
 /* Send a request to confirm that the program was successfully downloaded */
 static void request_update_status(void)
 {
+    TELEMETRY_PHASE(TIME_STATUS);
     wifly_put_string(CLEAR_STATUS_REQUEST);
     wifly_put_string(device_id);
+#ifdef COLLECT_BOOT_TELEMETRY
+    telemetry_put_query();
+#endif
     wifly_put_string(HTTP_FIELDS);
     wifly_put_string("\r\n");
 }
 
+#ifdef CACHE_SERVER_ADDRESS
+/* Load the cached server address and count this boot against its lifetime */
+static void server_load_address(void)
+{
+    eeprom_read_block(&server, SERVER_ADDRESS_EEPROM_ADDRESS, sizeof(server));
+    // An erased EEPROM has no address
+    if (server.lifetime > SERVER_ADDRESS_LIFETIME) {
+        server.address[0] = server.address[1] = 0;
+        server.address[2] = server.address[3] = 0;
+        server.lifetime = 0;
+    }
+    else if (server.lifetime > 0) {
+        eeprom_update_byte(SERVER_ADDRESS_EEPROM_ADDRESS + 4,
+            server.lifetime - 1);
+    }
+}
+#endif
+
 /* Send a byte response to the programmer */
 static void stk_byte_response(uint8_t val)
 {
@@ -1045,33 +2912,328 @@ static void stk_put_char(uint8_t ch)
     UDR0 = ch;
 }
 
+#ifdef COLLECT_BOOT_TELEMETRY
+/* Fill in the totals of the telemetry record */
+static void telemetry_close(void)
+{
+    telemetry.record[TIME_TOTAL] = (timer_read() - telemetry.start) >> 8;
+    telemetry.record[COUNT_WIFLY_RESETS] = wifly.errors.critical;
+    telemetry.record[COUNT_DOWNLOAD_RESETS] = download.errors.critical;
+#ifdef MEASURE_RAM_USAGE
+    telemetry.record[PEAK_STACK] = ram_stack_depth();
+#endif
+}
+
+/* Record the duration of the last chunk download, retries included */
+static void telemetry_end_chunk(void)
+{
+    TELEMETRY_COUNT(COUNT_CHUNKS);
+    telemetry_peak(TIME_SLOWEST_CHUNK,
+        (timer_read() - telemetry.chunk_start) >> 8);
+}
+
+/* Keep the highest value of a field */
+static void telemetry_peak(uint8_t field, uint16_t value)
+{
+    if (value > telemetry.record[field])
+        telemetry.record[field] = value;
+}
+
+/* Charge the time elapsed since the last switch to the current phase */
+static void telemetry_phase(uint8_t field)
+{
+    uint32_t now;
+    uint16_t elapsed;
+
+    if (field == telemetry.phase)
+        return;
+    now = timer_read();
+    elapsed = (now - telemetry.phase_start) >> 8;
+    telemetry.record[telemetry.phase] += elapsed;
+    // Carry the remainder over to the next phase
+    telemetry.phase_start += (uint32_t)elapsed << 8;
+    telemetry.phase = field;
+}
+
+/* Append the telemetry record to the query string of a request */
+static void telemetry_put_query(void)
+{
+    uint8_t i;
+
+    telemetry_close();
+    wifly_put_string("&t=");
+    for (i = 0; i < TELEMETRY_FIELDS; i++) {
+        if (i > 0)
+            wifly_put_char(',');
+        wifly_put_long(telemetry.record[i]);
+    }
+}
+
+/* Store the telemetry record in the EEPROM for the application */
+static void telemetry_save(void)
+{
+    // Close the current phase
+    telemetry_phase(TIME_TOTAL);
+    telemetry_close();
+    eeprom_update_block(telemetry.record, TELEMETRY_EEPROM_ADDRESS,
+        sizeof(telemetry.record));
+}
+#endif
+
+#ifdef BACKGROUND_TASKS
+/*
+ * Re-enable the RWW section once the Page Write running in the background is
+ * complete
+ */
+static void tasks_flash(void)
+{
+    if ((SPMCSR & ((1 << RWWSB) | (1 << SPMEN))) == (1 << RWWSB)) {
+        asm volatile(
+        "sts   %0,%1            \n\t"
+        "spm                    \n\t"
+        : "=m" (SPMCSR)
+        : "r" ((uint8_t)0x11)
+        );
+    }
+}
+
+/* Blink the LEDs while the bootloader is waiting */
+static void tasks_leds(void)
+{
+    uint32_t now = timer_read();
+
+    if ((int32_t)(now - tasks.led_deadline) < 0)
+        return;
+    tasks.led_deadline = now + LED_BLINK_PERIOD;
+    if ((*RED_LED_PORT & (1 << RED_LED_PIN))
+        || (*GREEN_LED_PORT & (1 << GREEN_LED_PIN))) {
+        // Remember the color set by the state machine and switch it off
+        tasks.leds = (*RED_LED_PORT & (1 << RED_LED_PIN)) ? 0x01 : 0x00;
+        if (*GREEN_LED_PORT & (1 << GREEN_LED_PIN))
+            tasks.leds |= 0x02;
+        *RED_LED_PORT &= ~(1 << RED_LED_PIN);
+        *GREEN_LED_PORT &= ~(1 << GREEN_LED_PIN);
+    }
+    else {
+        if (tasks.leds & 0x01)
+            *RED_LED_PORT |= (1 << RED_LED_PIN);
+        if (tasks.leds & 0x02)
+            *GREEN_LED_PORT |= (1 << GREEN_LED_PIN);
+    }
+}
+#endif
+
+#if defined(ENABLE_UART_TRACE) || defined(BACKGROUND_TASKS)
+/* Give each background task a chance to move forward, without waiting */
+static void tasks_run(void)
+{
+    // Count the Timer/Counter3 overflows in the loops that don't read it
+    timer_read();
+#ifdef ENABLE_UART_TRACE
+    trace_poll();
+#endif
+#ifdef BACKGROUND_TASKS
+    tasks_flash();
+    tasks_leds();
+#ifndef ENABLE_UART_TRACE
+    tasks_stk();
+#endif
+#endif
+}
+#endif
+
+#if defined(BACKGROUND_TASKS) && !defined(ENABLE_UART_TRACE)
+/* Hand over to the STK bootloader if a programmer shows up on UART0 */
+static void tasks_stk(void)
+{
+    if (!(UCSR0A & (1 << RXC0)))
+        return;
+    // avrdude starts with Get Synchronization commands
+    if (UDR0 != STK_GET_SYNC)
+        return;
+    write_bin_page_finish();
+    stk_nothing_response();
+    stk_timeout = false;
+    stk_errors = 0;
+    address.word = 0;
+    bootload_from_stk();
+    write_bin_page_finish();
+    // Watchdog Timer reset
+    WDTCSR = (1 << WDE);
+    while (1);
+}
+#endif
+
+#ifdef BACKGROUND_TASKS
+/* Wait for a number of Timer/Counter3 periods while running the tasks */
+static void tasks_wait(uint16_t ticks)
+{
+    uint32_t deadline = timer_read() + ticks;
+
+    while (!timer_expired(deadline))
+        tasks_run();
+}
+#endif
+
+#ifdef ENABLE_UART_TRACE
+/* Queue a trace event, or count it as dropped if the buffer is full */
+static void trace_event(uint8_t type, uint16_t argument)
+{
+    uint32_t timestamp = timer_read();
+    uint8_t space = (trace.tail - trace.head - 1) & (TRACE_BUFFER_SIZE - 1);
+    uint8_t i;
+
+    // Report the events lost since the last one that made it to the buffer
+    if (trace.dropped > 0 && space >= 2*TRACE_EVENT_SIZE) {
+        i = trace.dropped;
+        trace.dropped = 0;
+        trace_event(TRACE_EVENTS_DROPPED, i);
+        space -= TRACE_EVENT_SIZE;
+    }
+    if (space < TRACE_EVENT_SIZE) {
+        if (trace.dropped < 0xFF)
+            ++trace.dropped;
+        return;
+    }
+    trace.buffer[trace.head] = 0xA0 | type;
+    for (i = 1; i < TRACE_EVENT_SIZE; i++) {
+        trace.head = (trace.head + 1) & (TRACE_BUFFER_SIZE - 1);
+        if (i < 4) {
+            trace.buffer[trace.head] = (uint8_t)timestamp;
+            timestamp >>= 8;
+        }
+        else {
+            trace.buffer[trace.head] = (uint8_t)argument;
+            argument >>= 8;
+        }
+    }
+    trace.head = (trace.head + 1) & (TRACE_BUFFER_SIZE - 1);
+}
+
+/* Wait until the whole trace has been sent */
+static void trace_flush(void)
+{
+    while (trace.head != trace.tail)
+        trace_poll();
+    // Wait for the last byte to leave the shift register
+    while (!(UCSR0A & (1 << TXC0)));
+}
+
+/* Send the next trace byte if UART0 is ready, without waiting */
+static void trace_poll(void)
+{
+    if (trace.head != trace.tail && (UCSR0A & (1 << UDRE0))) {
+        // Clear the Transmit Complete flag by writing a logical one to its
+        // location
+        UCSR0A |= (1 << TXC0);
+        UDR0 = trace.buffer[trace.tail];
+        trace.tail = (trace.tail + 1) & (TRACE_BUFFER_SIZE - 1);
+    }
+}
+
+/* Send the header that marks the beginning of the trace */
+static void trace_start(void)
+{
+    stk_put_char('R');
+    stk_put_char('D');
+    stk_put_char('B');
+    stk_put_char('T');
+}
+#endif
+
+/* Check if a deadline computed from timer_read has passed */
+static bool timer_expired(uint32_t deadline)
+{
+    return (int32_t)(timer_read() - deadline) >= 0;
+}
+
+/*
+ * Count the Timer/Counter3 periods elapsed since reset. The Timer/Counter
+ * overflows every 4.2 seconds and only one overflow can be pending, so it must
+ * be read at least that often to keep track of the absolute time. Each polling
+ * loop of the internet update reads it through timer_expired or TASKS_RUN, and
+ * no other step of the update takes more than a second.
+ */
+static uint32_t timer_read(void)
+{
+    uint16_t count = TCNT3;
+
+    if (TIFR3 & (1 << TOV3)) {
+        // Clear the Overflow flag by writing a logical one to its location
+        TIFR3 |= (1 << TOV3);
+        ++timer_overflows;
+        // The count may have been read before the overflow
+        count = TCNT3;
+    }
+    return ((uint32_t)timer_overflows << 16) | count;
+}
+
+#ifdef THROTTLE_UPDATE_CHECKS
+/*
+ * Check if the update check policy calls for a check on this boot, and count
+ * the boot otherwise. A check starts the next interval, even if it fails,
+ * unless it resumes an update that the server had already confirmed.
+ */
+static bool throttle_check_due(void)
+{
+    bool pending;
+
+    eeprom_read_block(&throttle, THROTTLE_EEPROM_ADDRESS, sizeof(throttle));
+    // The previous check found an update and didn't install it
+    pending = (throttle.forced == THROTTLE_PENDING);
+#ifdef RESUME_INTERRUPTED_DOWNLOAD
+    // The journal describes a download that didn't complete
+    uint32_t journal_size = eeprom_read_dword((uint32_t*)JOURNAL_EEPROM_ADDRESS);
+    if (journal_size != 0 && journal_size != 0xFFFFFFFF)
+        pending = true;
+#endif
+    if (!pending && throttle.forced == THROTTLE_NOT_FORCED
+        && (throttle.boot_interval != 0xFF || throttle.hour_interval != 0xFFFF)
+        && (throttle.boot_interval == 0xFF
+        || throttle.boots + 1 < throttle.boot_interval)
+        && (throttle.hour_interval == 0xFFFF
+        || throttle.hours < throttle.hour_interval)) {
+        eeprom_update_byte(THROTTLE_EEPROM_ADDRESS + 2, throttle.boots + 1);
+        return false;
+    }
+    // The flag is set again once the server confirms the update
+    throttle.forced = THROTTLE_NOT_FORCED;
+    if (!pending) {
+        throttle.boots = 0;
+        throttle.hours = 0;
+    }
+    eeprom_update_block(&throttle, THROTTLE_EEPROM_ADDRESS, sizeof(throttle));
+    return true;
+}
+#endif
+
 /* Check if the WiFly is still associated with the access point */
 static bool wifly_check_socket(void)
 {
-    // Reset the Timer/Counter
-    TCNT3 = 0;
-    // Clear the Compare Match Flag by writing a logical one to its location
-    TIFR3 |= (1 << WLAN_OCF);
-    while (!(TIFR3 & (1 << WLAN_OCF))) {
+    uint32_t deadline = timer_read() + WLAN_TIMEOUT;
+
+    while (!timer_expired(deadline)) {
         // The WiFly drives its GPIO6 pin to HIGH when connected
         if (*GPIO6_PORT_INPUT & (1 << GPIO6_PIN))
             return true;
+        TASKS_RUN();
     }
+    TRACE(TRACE_TIMEOUT, WLAN_TIMEOUT_SOURCE);
     return false;
 }
 
 /* Check if the WiFly is still associated with the access point */
 static bool wifly_check_wlan(void)
 {
-    // Reset the Timer/Counter
-    TCNT3 = 0;
-    // Clear the Compare Match Flag by writing a logical one to its location
-    TIFR3 |= (1 << WLAN_OCF);
-    while (!(TIFR3 & (1 << WLAN_OCF))) {
+    uint32_t deadline = timer_read() + WLAN_TIMEOUT;
+
+    while (!timer_expired(deadline)) {
         // The WiFly drives its GPIO4 pin to LOW when associated
         if (*GPIO4_PORT_INPUT & (1 << GPIO4_PIN))
             return true;
+        TASKS_RUN();
     }
+    TRACE(TRACE_TIMEOUT, WLAN_TIMEOUT_SOURCE);
     return false;
 }
 
@@ -1086,29 +3248,74 @@ static void wifly_close_socket(void)
 static bool wifly_connect_to_host(void)
 {
     do {
+        TRACE(TRACE_WIFLY_STATE, wifly.state);
         if (wifly.state == RESETTING) {
+            TELEMETRY_PHASE(TIME_RESET);
             wifly_reset();
+#ifdef NEGOTIATE_WIFLY_BAUD_RATE
+            // Move the WiFly to the fastest baud rate that works
+            wifly_negotiate_baud_rate();
+#endif
             wifly.state = SETTING_HOST;
         }
         else if (wifly.state == SETTING_HOST) {
-            wifly_enter_command_mode();
+            TELEMETRY_PHASE(TIME_COMMAND);
+#ifdef CACHE_WIFLY_CONFIGURATION
+            // Skip command mode if the module has already saved the same
+            // configuration
+            if (eeprom_read_word(WIFLY_CONFIG_EEPROM_ADDRESS)
+                == wifly_config_hash()) {
+                wifly.state = JOINING_WLAN;
+            }
+            else
+#endif
             if (wifly_set_host()) {
                 wifly.state = JOINING_WLAN;
             }
-            else if (!add_error(&wifly.errors.command, MAX_COMMAND_ERRORS)) {
-                wifly.state = WIFLY_CRITICAL_ERROR;
+            else {
+                TELEMETRY_COUNT(COUNT_COMMAND_ERRORS);
+                if (!add_error(&wifly.errors.command, MAX_COMMAND_ERRORS))
+                    wifly.state = WIFLY_CRITICAL_ERROR;
             }
         }
         else if (wifly.state == JOINING_WLAN) {
+            TELEMETRY_PHASE(TIME_JOIN);
             if (!(*GPIO4_PORT_INPUT & (1 << GPIO4_PIN)))
                 wifly_join_wlan();
             if (wifly_check_wlan()) {
+#ifdef CACHE_SERVER_ADDRESS
+                // Resolve the host name again once the address has expired
+                if (server.lifetime == 0)
+                    wifly.state = RESOLVING_HOST;
+                else
+#endif
+                wifly.state = OPENING_SOCKET;
+            }
+            else {
+                TELEMETRY_COUNT(COUNT_WLAN_ERRORS);
+                if (!add_error(&wifly.errors.wlan, MAX_WLAN_ERRORS))
+                    wifly.state = WIFLY_CRITICAL_ERROR;
+            }
+        }
+#ifdef CACHE_SERVER_ADDRESS
+        else if (wifly.state == RESOLVING_HOST) {
+            TELEMETRY_PHASE(TIME_SOCKET);
+            // The configuration only changes with the address, and the WiFly
+            // keeps using the DNS name if the lookup fails
+            if (!wifly_lookup_host() || wifly_set_host()) {
                 wifly.state = OPENING_SOCKET;
             }
-            else if (!add_error(&wifly.errors.wlan, MAX_WLAN_ERRORS))
-                wifly.state = WIFLY_CRITICAL_ERROR;
+            else {
+                TELEMETRY_COUNT(COUNT_COMMAND_ERRORS);
+                if (!add_error(&wifly.errors.command, MAX_COMMAND_ERRORS))
+                    wifly.state = WIFLY_CRITICAL_ERROR;
+            }
         }
+#endif
         else if (wifly.state == OPENING_SOCKET) {
+            // The WiFly resolves the host name when it opens the socket,
+            // unless it has an address
+            TELEMETRY_PHASE(TIME_SOCKET);
             if (!(*GPIO6_PORT_INPUT & (1 << GPIO6_PIN)))
                 wifly_open_socket();
             if (wifly_check_socket()) {
@@ -1116,7 +3323,15 @@ static bool wifly_connect_to_host(void)
                 return true;
             }
             else {
+                TELEMETRY_COUNT(COUNT_SOCKET_ERRORS);
                 wifly_close_socket();
+#ifdef CACHE_SERVER_ADDRESS
+                // Check the cached address with a new lookup
+                if (server.address[0] != 0) {
+                    server.lifetime = 0;
+                    wifly.state = RESOLVING_HOST;
+                }
+#endif
                 if (!add_error(&wifly.errors.socket, MAX_SOCKET_ERRORS))
                     wifly.state = WIFLY_CRITICAL_ERROR;
             }
@@ -1129,6 +3344,11 @@ static bool wifly_connect_to_host(void)
                 ++wifly.errors.critical;
                 wifly.errors.wlan = 0;
                 wifly.errors.command = 0;
+#ifdef CACHE_WIFLY_CONFIGURATION
+                // The module may have lost its configuration, so apply it
+                // again on the next attempt
+                eeprom_update_word(WIFLY_CONFIG_EEPROM_ADDRESS, 0xFFFF);
+#endif
                 wifly.state = RESETTING;
             }
         }
@@ -1138,9 +3358,11 @@ static bool wifly_connect_to_host(void)
 /* Ask the WiFly to enter command mode */
 static void wifly_enter_command_mode(void)
 {
-    _delay_ms(250);
+    if (wifly.command_mode)
+        return;
+    WAIT_MS(250);
     wifly_put_string("$$$");
-    wifly_find_string("CMD");
+    wifly.command_mode = wifly_find_string("CMD");
 }
 
 /* Scan the stream coming from the WiFly and look for a specific string */
@@ -1176,22 +3398,42 @@ static bool wifly_find_string(const char* target)
 /* Read a byte from the WiFly */
 static uint8_t wifly_get_char(void)
 {
-    // Reset the Timer/Counter
-    TCNT3 = 0;
-    // Clear the Compare Match flag by writing a logical one to its location
-    TIFR3 |= (1 << UART_OCF);
-    // The flag is set again on compare match
-    while (!(TIFR3 & (1 << UART_OCF))) {
+    uint32_t deadline;
+
+    if (http.body) {
+        // Never read past the body of an HTTP response
+        if (http.remaining == 0)
+            return 0;
+        --http.remaining;
+    }
+#ifdef WIFLY_FLOW_CONTROL
+    // Let the WiFly send
+    *CTS_PORT &= ~(1 << CTS_PIN);
+#endif
+    // Don't bother with the timer if a byte is already waiting
+    if ((UCSR1A & (1 << RXC1)))
+        return UDR1;
+    deadline = timer_read() + UART_TIMEOUT;
+    while (!timer_expired(deadline)) {
       if ((UCSR1A & (1 << RXC1))) {
         return UDR1;
       }
+      TASKS_RUN();
     }
+    TRACE(TRACE_TIMEOUT, UART_TIMEOUT_SOURCE);
+    // The rest of the HTTP response can't be found anymore
+    http.body = false;
     return 0;
 }
 
 /* Command the WiFly to join the WLAN stored in memory */
 static void wifly_join_wlan(void)
 {
+#ifdef CACHE_WIFLY_CONFIGURATION
+    // Command mode is skipped when the configuration is already saved
+    if (!wifly.command_mode)
+        wifly_enter_command_mode();
+#endif
     wifly_put_string("join\r");
 }
 
@@ -1206,7 +3448,22 @@ static void wifly_open_socket(void)
 /* Send a byte to the WiFly */
 static void wifly_put_char(uint8_t ch)
 {
-    while (!(UCSR1A & (1 << UDRE1)));
+#ifdef WIFLY_FLOW_CONTROL
+    uint32_t deadline = timer_read() + UART_TIMEOUT;
+
+    // Wait until the WiFly can receive
+    while (!wifly.rts_stuck && (*RTS_PORT_INPUT & (1 << RTS_PIN))) {
+        if (timer_expired(deadline)) {
+            // RTS is unwired or flow control is off in the WiFly, so stop
+            // waiting for it and let the commands and requests fail instead
+            TRACE(TRACE_TIMEOUT, UART_TIMEOUT_SOURCE);
+            wifly.rts_stuck = true;
+        }
+        TASKS_RUN();
+    }
+#endif
+    while (!(UCSR1A & (1 << UDRE1)))
+        TASKS_RUN();
     UDR1 = ch;
 }
 
@@ -1240,18 +3497,264 @@ static void wifly_reset(void)
     _delay_ms(1);
     *RESET_PORT |= (1 << RESET_PIN);
     // Boot time is 150 ms for the RN171
-    _delay_ms(150);
+    WAIT_MS(150);
+    wifly.command_mode = false;
+#ifdef NEGOTIATE_WIFLY_BAUD_RATE
+    // The WiFly is back to its saved baud rate
+    wifly_reset_baud_rate();
+#endif
+}
+
+/* Set the UART1 baud rate back to the one the WiFly uses after a reset */
+static void wifly_reset_baud_rate(void)
+{
+    uint8_t index = eeprom_read_byte(WIFLY_BAUD_EEPROM_ADDRESS);
+
+    // The negotiation may have saved a raw baud rate in the WiFly
+    if (index < WIFLY_RAW_BAUD_RATES) {
+        wifly_set_baud_rate(WIFLY_FAST_BAUD_RATE[index]);
+        return;
+    }
+#if WIFLY_BAUD_RATE >= 115200
+    UBRR1L = (uint8_t)(F_CPU/(WIFLY_BAUD_RATE*4L) - 1)/2;
+    UBRR1H = (F_CPU/(WIFLY_BAUD_RATE*4L) - 1)/2 >> 8;
+    UCSR1A = (1 << U2X1);
+#else
+    UBRR1L = (uint8_t)(F_CPU/(WIFLY_BAUD_RATE*8L) - 1)/2;
+    UBRR1H = (F_CPU/(WIFLY_BAUD_RATE*8L) - 1)/2 >> 8;
+    UCSR1A = 0x00;
+#endif
+}
+
+#ifdef NEGOTIATE_WIFLY_BAUD_RATE
+/*
+ * Switch to the fastest baud rate that works, starting with the one that
+ * worked last time. The result is stored in the EEPROM so that a board only
+ * goes through the whole list once.
+ */
+static bool wifly_negotiate_baud_rate(void)
+{
+    uint8_t index = eeprom_read_byte(WIFLY_BAUD_EEPROM_ADDRESS);
+    enum baud_rate_status status;
+
+    // No faster baud rate worked on this board
+    if (index == WIFLY_FAST_BAUD_RATES)
+        return false;
+    // The WiFly already starts at the raw baud rate saved in it
+    if (index < WIFLY_RAW_BAUD_RATES)
+        return true;
+    if (index < WIFLY_FAST_BAUD_RATES) {
+        status = wifly_switch_baud_rate(index);
+        if (status == BAUD_RATE_SWITCHED)
+            return true;
+        if (status == BAUD_RATE_NO_COMMAND_MODE)
+            return false;
+    }
+    for (index = 0; index < WIFLY_FAST_BAUD_RATES; index++) {
+        status = wifly_switch_baud_rate(index);
+        if (status == BAUD_RATE_SWITCHED)
+            break;
+        // The WiFly didn't answer at its saved baud rate, which says nothing
+        // about the faster ones, so leave the stored index alone
+        if (status == BAUD_RATE_NO_COMMAND_MODE)
+            return false;
+    }
+    eeprom_update_byte(WIFLY_BAUD_EEPROM_ADDRESS, index);
+    return (index < WIFLY_FAST_BAUD_RATES);
+}
+
+/* Move the WiFly and UART1 to a faster baud rate and check the link */
+static enum baud_rate_status wifly_switch_baud_rate(uint8_t index)
+{
+    uint32_t rate = WIFLY_FAST_BAUD_RATE[index];
+    uint16_t ubrr = (F_CPU/(rate*4L) - 1)/2;
+    uint32_t actual = F_CPU/(8L*(ubrr + 1));
+
+    // Skip the baud rates that can't be generated within 2% of error, and
+    // those that aren't faster than the saved one
+    if ((actual > rate ? actual - rate : rate - actual) > rate/50
+        || rate <= WIFLY_BAUD_RATE)
+        return BAUD_RATE_REJECTED;
+    wifly_enter_command_mode();
+    if (!wifly.command_mode)
+        return BAUD_RATE_NO_COMMAND_MODE;
+    if (index < WIFLY_RAW_BAUD_RATES) {
+        if (!wifly_save_baud_rate(rate)) {
+            wifly_reset();
+            return BAUD_RATE_REJECTED;
+        }
+        // The WiFly comes back at the new baud rate, and so does UART1
+        eeprom_update_byte(WIFLY_BAUD_EEPROM_ADDRESS, index);
+        wifly_reset();
+    }
+    else {
+        // The WiFly switches immediately and leaves command mode without
+        // acknowledging the command
+        wifly_put_string("set uart instant ");
+        wifly_put_long(rate);
+        wifly_put_char('\r');
+        WAIT_MS(20);
+        wifly.command_mode = false;
+        wifly_set_baud_rate(rate);
+        // Discard anything received during the switch
+        while (UCSR1A & (1 << RXC1))
+            UDR1;
+    }
+    // Entering command mode at the new baud rate proves the link works
+    wifly_enter_command_mode();
+    if (wifly.command_mode)
+        return BAUD_RATE_SWITCHED;
+    if (index < WIFLY_RAW_BAUD_RATES) {
+        // Save the usual baud rate back, without waiting for answers that
+        // can't be read at the new one
+        WAIT_MS(250);
+        wifly_put_string("$$$");
+        WAIT_MS(250);
+        wifly_put_string("\rset uart raw ");
+        wifly_put_long(WIFLY_BAUD_RATE);
+        wifly_put_string("\rsave\r");
+        WAIT_MS(100);
+        wifly_put_string("reboot\r");
+        eeprom_update_byte(WIFLY_BAUD_EEPROM_ADDRESS, 0xFF);
+        wifly_reset();
+        wifly_enter_command_mode();
+        if (!wifly.command_mode) {
+            // The WiFly kept the new baud rate, so keep using it
+            eeprom_update_byte(WIFLY_BAUD_EEPROM_ADDRESS, index);
+            return BAUD_RATE_NO_COMMAND_MODE;
+        }
+        return BAUD_RATE_REJECTED;
+    }
+    // The baud rate of the WiFly is unknown, a reset restores the saved one
+    wifly_reset();
+    return BAUD_RATE_REJECTED;
+}
+
+/* Save a raw baud rate in the WiFly, which applies it after a reboot */
+static bool wifly_save_baud_rate(uint32_t rate)
+{
+    wifly_put_string("set uart raw ");
+    wifly_put_long(rate);
+    wifly_put_char('\r');
+    if (!wifly_find_string("AOK"))
+        return false;
+    wifly_put_string("save\r");
+    if (!wifly_find_string("Storing in config"))
+        return false;
+    wifly_put_string("reboot\r");
+    wifly.command_mode = false;
+    return true;
+}
+#endif
+
+/* Set the UART1 baud rate, with the double speed mode */
+static void wifly_set_baud_rate(uint32_t rate)
+{
+    uint16_t ubrr = (F_CPU/(rate*4L) - 1)/2;
+
+    UBRR1H = ubrr >> 8;
+    UBRR1L = (uint8_t)ubrr;
+    UCSR1A = (1 << U2X1);
+}
+
+#ifdef CACHE_WIFLY_CONFIGURATION
+/* Compute the fingerprint of the configuration applied by wifly_set_host */
+static uint16_t wifly_config_hash(void)
+{
+    uint16_t hash = hash_string(hash_string(5381, SET_REMOTE_PORT_COMMAND),
+        SET_DNS_NAME_COMMAND);
+#ifdef CACHE_SERVER_ADDRESS
+    uint8_t i;
+
+    for (i = 0; i < 4; i++)
+        hash = (hash << 5) + hash + server.address[i];
+#endif
+    return hash;
 }
+#endif
 
 /* Set the program host */
 static bool wifly_set_host(void)
 {
-    wifly_put_string("set ip remote 80\r");
+#ifdef CACHE_SERVER_ADDRESS
+    uint8_t index;
+
+#endif
+    wifly_enter_command_mode();
+    wifly_put_string(SET_REMOTE_PORT_COMMAND);
+    if (!wifly_find_string("AOK"))
+        return false;
+    wifly_put_string(SET_DNS_NAME_COMMAND);
+#ifdef CACHE_SERVER_ADDRESS
     if (!wifly_find_string("AOK"))
         return false;
-    wifly_put_string("set dns name " PROGRAM_HOST "\r");
+    // Connect by address, the DNS name is only used with 0.0.0.0
+    wifly_put_string(SET_HOST_ADDRESS_COMMAND);
+    for (index = 0; index < 4; index++) {
+        if (index > 0)
+            wifly_put_char('.');
+        wifly_put_long(server.address[index]);
+    }
+    wifly_put_char('\r');
+#endif
+#ifndef CACHE_WIFLY_CONFIGURATION
     return wifly_find_string("AOK");
+#else
+    if (!wifly_find_string("AOK"))
+        return false;
+    // Save the configuration in the module so that it survives resets, then
+    // remember it was saved
+    wifly_put_string("save\r");
+    if (!wifly_find_string("Storing in config"))
+        return false;
+    eeprom_update_word(WIFLY_CONFIG_EEPROM_ADDRESS, wifly_config_hash());
+    return true;
+#endif
+}
+
+#ifdef CACHE_SERVER_ADDRESS
+/*
+ * Ask the WiFly to resolve the host name and cache the address it gives
+ * Return true if the address given to the WiFly must change.
+ */
+static bool wifly_lookup_host(void)
+{
+    uint8_t address[4] = {0, 0, 0, 0};
+    uint8_t index;
+    uint16_t value = 0;
+    bool changed = false;
+    uint8_t ch;
+
+    wifly_enter_command_mode();
+    wifly_put_string(LOOKUP_HOST_COMMAND);
+    // The WiFly replies with "<host>=<address>"
+    if (wifly_find_string(LOOKUP_HOST_REPLY)) {
+        for (index = 0; index < 4; index++) {
+            value = 0;
+            while ((ch = wifly_get_char()) >= '0' && ch <= '9' && value < 256)
+                value = value*10 + ch - '0';
+            // Every number but the last one ends with a dot
+            if (value > 255 || (index < 3 && ch != '.'))
+                break;
+            address[index] = value;
+        }
+        if (index == 4)
+            server.lifetime = SERVER_ADDRESS_LIFETIME;
+        else
+            address[0] = 0;
+    }
+    // Without an address, fall back to the DNS name
+    if (address[0] == 0)
+        address[1] = address[2] = address[3] = 0;
+    for (index = 0; index < 4; index++) {
+        if (server.address[index] != address[index])
+            changed = true;
+        server.address[index] = address[index];
+    }
+    eeprom_update_block(&server, SERVER_ADDRESS_EEPROM_ADDRESS, sizeof(server));
+    return changed;
 }
+#endif
 
 /*
  * Write a binary page to the Flash memory
@@ -1259,15 +3762,22 @@ static bool wifly_set_host(void)
  */
 static void write_bin_page(void)
 {
-    if (address.byte[1] > 127) {
-        RAMPZ = 0x01;
-    }
-    else {
-        RAMPZ = 0x00;
-    }
+    uint16_t target;
+
+    // The loop below only stops at a count of 0 after a decrement, so an
+    // empty page would erase the target page and program the whole bank
+    if (length.word == 0)
+        return;
+    TELEMETRY_PEAK(PEAK_BIN_BUFFER, length.word);
+#ifdef WIFLY_FLOW_CONTROL
+    // UART1 isn't polled during self-programming, hold the data in the WiFly
+    *CTS_PORT |= (1 << CTS_PIN);
+#endif
     // Since the address sent via STK is the word address, address*2 yields
-    // the byte address
-    address.word = address.word << 1;
+    // the byte address: the lower 16 bits go to the Z pointer and the upper
+    // bits to RAMPZ
+    RAMPZ = address.word >> 15;
+    target = address.word << 1;
     // Even up an odd number of bytes
     if ((length.byte[0] & 0x01))
         length.word++;
@@ -1276,9 +3786,7 @@ static void write_bin_page(void)
     asm volatile(
     // Clear register R17 which will be used as word counter
     "clr   r17              \n\t"
-    // Load the target Flash address to pointer register Z (R31:R30)
-    "lds   r30,address      \n\t"
-    "lds   r31,address+1    \n\t"
+    // The target Flash address is already in pointer register Z (R31:R30)
     // Load the binary buffer address to pointer register Y (R29:R28)
     "ldi   r28,lo8(bin_buffer)\n\t"
     "ldi   r29,hi8(bin_buffer)\n\t"
@@ -1339,7 +3847,7 @@ static void write_bin_page(void)
     // If the word count is lower than the page size, it means the current
     // page is still in the process of being loaded to the temporary page
     // buffer, therefore the Page Write operation must be skipped
-    "cpi   r17,%1           \n\t"
+    "cpi   r17,%2           \n\t"
     "brlo  no_page_write    \n\t"
 
     // Else the word count has reached the page size, which means the page has
@@ -1358,6 +3866,15 @@ static void write_bin_page(void)
     "ldi   r16,0x05         \n\t"
     "sts   %0,r16           \n\t"
     "spm                    \n\t"
+#ifdef BACKGROUND_TASKS
+    // If this is the last word of the block, let the Page Write operation
+    // complete in the background: the RWW section is re-enabled by
+    // tasks_flash or write_bin_page_finish
+    "cpi   r25,0x00         \n\t"
+    "brne  wait_spm5        \n\t"
+    "cpi   r24,0x02         \n\t"
+    "breq  no_page_write    \n\t"
+#endif
     // Wait for the previous SPM instruction to complete
     "wait_spm5:             \n\t"
     "lds   r16,%0           \n\t"
@@ -1396,8 +3913,21 @@ static void write_bin_page(void)
     "block_done:            \n\t"
     // Restore register R0 and exit
     "clr   __zero_reg__     \n\t"
-    : "=m" (SPMCSR)
+    : "=m" (SPMCSR), "+z" (target)
     : "M" (FLASH_PAGE_SIZE)
-    : "r0","r16","r17","r24","r25","r28","r29","r30","r31"
+    : "r0","r16","r17","r24","r25","r28","r29"
     );
 }
+
+#ifdef BACKGROUND_TASKS
+/*
+ * Wait for the Page Write running in the background to complete and
+ * re-enable the RWW section
+ */
+static void write_bin_page_finish(void)
+{
+    // Wait for the previous SPM instruction to complete
+    while (SPMCSR & (1 << SPMEN));
+    tasks_flash();
+}
+#endif
@@ -0,0 +1,409 @@
+/* reaDIYboot fleet load generator
+ * Copyright (C) 2011-2012 reaDIYmate
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Simulate a fleet of boards rebooting after a release: each simulated
+ * bootloader sends the same requests as reaDIYboot (status, HEAD, Range GETs
+ * of HEX_BUFFER_SIZE bytes minus the leftover of the previous chunk, clear),
+ * reads the responses no faster than its link allows, and the latency of the
+ * server and its egress are reported.
+ *
+ * Usage: fleet_load [options] <host> <HEX file path>
+ */
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <mutex>
+#include <random>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+/* Size of the blocks read from the socket */
+const size_t READ_BLOCK = 256;
+/* Timeout of the socket operations, in seconds (like HTTP_TIMEOUT) */
+const int SOCKET_TIMEOUT = 4;
+/* Number of attempts of each request (like MAX_HTTP_ERRORS + 1) */
+const unsigned MAX_ATTEMPTS = 4;
+
+struct Options {
+    std::string host;
+    std::string port = "80";
+    std::string path;
+    std::string status_request;
+    std::string clear_request;
+    std::string json_prefix = "\"path\":\"";
+    std::string user_agent = "reaDIYboot";
+    unsigned devices = 100;
+    size_t chunk_size = 4096;
+    double link_rate = 11520;
+    double jitter = 10.0;
+    double chunk_delay_ms = 0;
+    bool indirection = false;
+    bool status_twice = false;
+};
+
+enum RequestKind {
+    STATUS,
+    HEAD,
+    CHUNK,
+    CLEAR,
+    REQUEST_KINDS
+};
+
+const char* const KIND_NAMES[REQUEST_KINDS] = {"status", "HEAD", "chunk",
+    "clear"};
+
+struct Sample {
+    double first_byte_ms;
+    double total_ms;
+};
+
+struct Response {
+    int status = 0;
+    std::string body;
+    size_t content_length = 0;
+};
+
+Options options;
+std::mutex stats_mutex;
+std::vector<Sample> samples[REQUEST_KINDS];
+std::atomic<unsigned long long> egress(0);
+std::atomic<unsigned> failures(0);
+std::atomic<unsigned> completed(0);
+
+double milliseconds(Clock::duration duration)
+{
+    return std::chrono::duration<double, std::milli>(duration).count();
+}
+
+class Device {
+public:
+    Device(unsigned index) : id_(make_id(index)) {}
+    ~Device() { disconnect(); }
+
+    bool run();
+
+private:
+    static std::string make_id(unsigned index);
+
+    bool connect();
+    void disconnect();
+    bool exchange(RequestKind kind, const std::string& request,
+        bool head, Response& response);
+    bool attempt(RequestKind kind, const std::string& request, bool head,
+        Response& response);
+    bool receive(char* data, size_t size);
+    std::string fields() const;
+
+    std::string id_;
+    int fd_ = -1;
+    // Pace of the simulated link
+    Clock::time_point link_start_;
+    unsigned long long link_bytes_ = 0;
+};
+
+std::string Device::make_id(unsigned index)
+{
+    char id[16];
+    std::snprintf(id, sizeof(id), "dev%05u", index);
+    return id;
+}
+
+bool Device::connect()
+{
+    addrinfo hints = {};
+    hints.ai_family = AF_INET;
+    hints.ai_socktype = SOCK_STREAM;
+    addrinfo* result;
+    if (getaddrinfo(options.host.c_str(), options.port.c_str(), &hints,
+        &result) != 0)
+        return false;
+    fd_ = socket(result->ai_family, result->ai_socktype, result->ai_protocol);
+    if (fd_ >= 0 && ::connect(fd_, result->ai_addr, result->ai_addrlen) != 0)
+        disconnect();
+    freeaddrinfo(result);
+    if (fd_ < 0)
+        return false;
+    timeval timeout = {SOCKET_TIMEOUT, 0};
+    setsockopt(fd_, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+    setsockopt(fd_, SOL_SOCKET, SO_SNDTIMEO, &timeout, sizeof(timeout));
+    // A small receive buffer makes the slow link push back on the server
+    int buffer = 4096;
+    setsockopt(fd_, SOL_SOCKET, SO_RCVBUF, &buffer, sizeof(buffer));
+    link_start_ = Clock::now();
+    link_bytes_ = 0;
+    return true;
+}
+
+void Device::disconnect()
+{
+    if (fd_ >= 0)
+        close(fd_);
+    fd_ = -1;
+}
+
+/* Same fields as HTTP_FIELDS in reaDIYboot.c */
+std::string Device::fields() const
+{
+    return " HTTP/1.1\r\n"
+        "User-Agent: " + options.user_agent + "\r\n"
+        "Host: " + options.host + "\r\n"
+        "Connection: Keep-Alive\r\n";
+}
+
+/* Read exactly size bytes, no faster than the simulated link */
+bool Device::receive(char* data, size_t size)
+{
+    while (size > 0) {
+        size_t block = std::min(size, READ_BLOCK);
+        if (options.link_rate > 0) {
+            auto due = link_start_ + std::chrono::microseconds(
+                static_cast<long long>(link_bytes_ * 1e6 / options.link_rate));
+            std::this_thread::sleep_until(due);
+        }
+        ssize_t count = recv(fd_, data, block, 0);
+        if (count <= 0)
+            return false;
+        data += count;
+        size -= count;
+        link_bytes_ += count;
+        egress += count;
+    }
+    return true;
+}
+
+bool Device::attempt(RequestKind kind, const std::string& request, bool head,
+    Response& response)
+{
+    if (fd_ < 0 && !connect())
+        return false;
+    Clock::time_point start = Clock::now();
+    if (send(fd_, request.data(), request.size(), MSG_NOSIGNAL)
+        != static_cast<ssize_t>(request.size()))
+        return false;
+
+    // Read the header one byte at a time, like wifly_find_string
+    std::string header;
+    Clock::time_point first_byte;
+    char ch;
+    while (header.size() < 4
+        || header.compare(header.size() - 4, 4, "\r\n\r\n") != 0) {
+        if (!receive(&ch, 1) || header.size() > 8192)
+            return false;
+        if (header.empty())
+            first_byte = Clock::now();
+        header += ch;
+    }
+    response.status = std::atoi(header.c_str() + header.find(' ') + 1);
+    size_t field = header.find("Content-Length: ");
+    if (field == std::string::npos)
+        return false;
+    response.content_length = std::strtoul(header.c_str() + field + 16,
+        nullptr, 10);
+    if (!head) {
+        response.body.resize(response.content_length);
+        if (!receive(&response.body[0], response.content_length))
+            return false;
+    }
+    Clock::time_point done = Clock::now();
+
+    std::lock_guard<std::mutex> lock(stats_mutex);
+    samples[kind].push_back({milliseconds(first_byte - start),
+        milliseconds(done - start)});
+    return true;
+}
+
+/* Send a request and read the response, retrying like http_send */
+bool Device::exchange(RequestKind kind, const std::string& request, bool head,
+    Response& response)
+{
+    for (unsigned i = 0; i < MAX_ATTEMPTS; i++) {
+        response = Response();
+        if (attempt(kind, request, head, response)
+            && response.status >= 200 && response.status < 300)
+            return true;
+        ++failures;
+        // The WiFly closes the socket and reconnects after an error
+        disconnect();
+    }
+    return false;
+}
+
+bool Device::run()
+{
+    Response response;
+    std::string path = options.path;
+
+    if (!options.status_request.empty()) {
+        // With CHECK_STATUS_BEFORE_DOWNLOAD and USE_URL_INDIRECTION, the status
+        // call is sent once to check the update and once more for the path
+        for (int call = options.status_twice ? 2 : 1; call > 0; call--) {
+            if (!exchange(STATUS, "GET " + options.status_request + id_
+                + fields() + "\r\n", false, response))
+                return false;
+        }
+        if (options.indirection) {
+            size_t start = response.body.find(options.json_prefix);
+            if (start == std::string::npos)
+                return false;
+            start += options.json_prefix.size();
+            path = response.body.substr(start,
+                response.body.find('"', start) - start);
+        }
+    }
+
+    if (!exchange(HEAD, "HEAD " + path + fields() + "\r\n", true, response))
+        return false;
+    size_t size = response.content_length;
+
+    // Same chunking as request_get_chunk and download_append_leftover
+    size_t file_start = 0;
+    size_t leftover = 0;
+    while (file_start < size) {
+        size_t file_stop = std::min(file_start - leftover
+            + options.chunk_size - 1, size - 1);
+        if (!exchange(CHUNK, "GET " + path + fields() + "Range: bytes="
+            + std::to_string(file_start) + "-" + std::to_string(file_stop)
+            + "\r\n\r\n", false, response))
+            return false;
+        size_t line_end = response.body.find_last_of('\n');
+        leftover = line_end == std::string::npos ? response.body.size()
+            : response.body.size() - line_end - 1;
+        file_start = file_stop + 1;
+        if (options.chunk_delay_ms > 0)
+            std::this_thread::sleep_for(std::chrono::microseconds(
+                static_cast<long long>(options.chunk_delay_ms * 1000)));
+    }
+
+    if (!options.clear_request.empty()
+        && !exchange(CLEAR, "GET " + options.clear_request + id_ + fields()
+            + "\r\n", false, response))
+        return false;
+    return true;
+}
+
+void simulate(unsigned index, double delay)
+{
+    std::this_thread::sleep_for(std::chrono::microseconds(
+        static_cast<long long>(delay * 1e6)));
+    Device device(index);
+    if (device.run())
+        ++completed;
+}
+
+double percentile(std::vector<double>& values, double fraction)
+{
+    if (values.empty())
+        return 0;
+    std::sort(values.begin(), values.end());
+    size_t index = static_cast<size_t>(fraction * (values.size() - 1) + 0.5);
+    return values[index];
+}
+
+void report(double seconds)
+{
+    std::printf("%-8s %7s %12s %12s %12s %12s\n", "request", "count",
+        "first p50", "first p99", "total p50", "total p99");
+    for (unsigned kind = 0; kind < REQUEST_KINDS; kind++) {
+        if (samples[kind].empty())
+            continue;
+        std::vector<double> first;
+        std::vector<double> total;
+        for (const Sample& sample : samples[kind]) {
+            first.push_back(sample.first_byte_ms);
+            total.push_back(sample.total_ms);
+        }
+        std::printf("%-8s %7zu %9.1f ms %9.1f ms %9.1f ms %9.1f ms\n",
+            KIND_NAMES[kind], samples[kind].size(), percentile(first, 0.5),
+            percentile(first, 0.99), percentile(total, 0.5),
+            percentile(total, 0.99));
+    }
+    double megabytes = egress / 1e6;
+    std::printf("-- %u/%u devices updated in %.1f s, %u failed requests, "
+        "egress %.2f MB (%.2f MB/s)\n", completed.load(), options.devices,
+        seconds, failures.load(), megabytes,
+        seconds > 0 ? megabytes / seconds : 0);
+}
+
+void usage(const char* program)
+{
+    std::fprintf(stderr,
+        "usage: %s [-n devices] [-p port] [-c chunk size] [-r link B/s]\n"
+        "       [-j jitter s] [-d chunk delay ms] [-s status request]"
+        " [-x clear request]\n"
+        "       [-i] [-t] [-P JSON prefix] [-a user agent]"
+        " <host> <HEX file path>\n",
+        program);
+}
+
+} // namespace
+
+int main(int argc, char** argv)
+{
+    int option;
+    while ((option = getopt(argc, argv, "n:p:c:r:j:d:s:x:itP:a:")) != -1) {
+        switch (option) {
+            case 'n': options.devices = std::atoi(optarg); break;
+            case 'p': options.port = optarg; break;
+            case 'c': options.chunk_size = std::atoi(optarg); break;
+            case 'r': options.link_rate = std::atof(optarg); break;
+            case 'j': options.jitter = std::atof(optarg); break;
+            case 'd': options.chunk_delay_ms = std::atof(optarg); break;
+            case 's': options.status_request = optarg; break;
+            case 'x': options.clear_request = optarg; break;
+            case 'i': options.indirection = true; break;
+            case 't': options.status_twice = true; break;
+            case 'P': options.json_prefix = optarg; break;
+            case 'a': options.user_agent = optarg; break;
+            default: usage(argv[0]); return 2;
+        }
+    }
+    if (optind != argc - 2 || options.chunk_size == 0) {
+        usage(argv[0]);
+        return 2;
+    }
+    options.host = argv[optind];
+    options.path = argv[optind + 1];
+
+    // The boards don't reboot at exactly the same time
+    std::mt19937 random(12345);
+    std::uniform_real_distribution<double> jitter(0, options.jitter);
+    std::vector<std::thread> threads;
+    Clock::time_point start = Clock::now();
+    for (unsigned i = 0; i < options.devices; i++)
+        threads.emplace_back(simulate, i, jitter(random));
+    for (std::thread& thread : threads)
+        thread.join();
+    report(milliseconds(Clock::now() - start) / 1000);
+    return completed == options.devices ? 0 : 1;
+}
@@ -0,0 +1,171 @@
+/* reaDIYboot HEX file packer
+ * Copyright (C) 2011-2012 reaDIYmate
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Rewrite a HEX file in the packed layout detected by reaDIYboot when it is
+ * built with PACKED_HEX_FAST_PATH: a marker line, then records of 128 bytes
+ * which all have the same length and line up with the Flash pages, the last
+ * page being padded with 0xFF, then the End Of File record.
+ *
+ * Usage: hex_pack [-p page size] <input HEX file> <output HEX file>
+ */
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <string>
+#include <vector>
+
+#include <unistd.h>
+
+namespace {
+
+/* Must match PACKED_HEX_MARKER and PACKED_RECORD_SIZE in reaDIYboot.c */
+const char MARKER[] = ":080000525244425950414B3168\r\n";
+const unsigned RECORD_SIZE = 128;
+
+int hex_value(char c)
+{
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    if (c >= 'A' && c <= 'F')
+        return c - 'A' + 10;
+    if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    return -1;
+}
+
+bool parse_bytes(const std::string& text, std::vector<uint8_t>& bytes)
+{
+    if (text.size() % 2 != 0)
+        return false;
+    for (size_t i = 0; i < text.size(); i += 2) {
+        int high = hex_value(text[i]);
+        int low = hex_value(text[i + 1]);
+        if (high < 0 || low < 0)
+            return false;
+        bytes.push_back(high << 4 | low);
+    }
+    return true;
+}
+
+/* Load the data records of a HEX file into a binary image */
+bool load(const char* path, std::vector<uint8_t>& image)
+{
+    std::ifstream file(path);
+    if (!file) {
+        std::perror(path);
+        return false;
+    }
+    uint32_t base = 0;
+    std::string line;
+    unsigned number = 0;
+    while (std::getline(file, line)) {
+        ++number;
+        if (!line.empty() && line.back() == '\r')
+            line.pop_back();
+        if (line.empty())
+            continue;
+        std::vector<uint8_t> bytes;
+        if (line[0] != ':' || !parse_bytes(line.substr(1), bytes)
+            || bytes.size() < 5 || bytes.size() != bytes[0] + 5u) {
+            std::fprintf(stderr, "%s:%u: malformed line\n", path, number);
+            return false;
+        }
+        uint8_t sum = 0;
+        for (uint8_t byte : bytes)
+            sum += byte;
+        if (sum != 0) {
+            std::fprintf(stderr, "%s:%u: bad checksum\n", path, number);
+            return false;
+        }
+        uint16_t address = bytes[1] << 8 | bytes[2];
+        uint8_t type = bytes[3];
+        if (type == 0x00) {
+            uint32_t start = base + address;
+            if (image.size() < start + bytes[0])
+                image.resize(start + bytes[0], 0xFF);
+            for (unsigned i = 0; i < bytes[0]; i++)
+                image[start + i] = bytes[4 + i];
+        }
+        else if (type == 0x01)
+            break;
+        else if (type == 0x02)
+            base = (bytes[4] << 8 | bytes[5]) << 4;
+        else if (type == 0x04)
+            base = (bytes[4] << 8 | bytes[5]) << 16;
+        // Start address records are useless to the bootloader
+    }
+    return true;
+}
+
+void put_record(std::FILE* output, uint8_t type, uint16_t address,
+    const uint8_t* data, unsigned size)
+{
+    uint8_t sum = size + (address >> 8) + address + type;
+    std::fprintf(output, ":%02X%04X%02X", size, address, type);
+    for (unsigned i = 0; i < size; i++) {
+        std::fprintf(output, "%02X", data[i]);
+        sum += data[i];
+    }
+    std::fprintf(output, "%02X\r\n", static_cast<uint8_t>(-sum));
+}
+
+} // namespace
+
+int main(int argc, char** argv)
+{
+    unsigned page_size = 256;
+    int option;
+    while ((option = getopt(argc, argv, "p:")) != -1) {
+        if (option == 'p')
+            page_size = std::strtoul(optarg, nullptr, 0);
+        else
+            break;
+    }
+    if (optind != argc - 2 || page_size == 0 || page_size % RECORD_SIZE) {
+        std::fprintf(stderr,
+            "usage: %s [-p page size] <input HEX file> <output HEX file>\n",
+            argv[0]);
+        return 2;
+    }
+
+    std::vector<uint8_t> image;
+    if (!load(argv[optind], image))
+        return 1;
+    // The bootloader writes the data sequentially from address 0, so the gaps
+    // are already filled with 0xFF, and the last page is padded too
+    image.resize((image.size() + page_size - 1) / page_size * page_size,
+        0xFF);
+
+    std::FILE* output = std::fopen(argv[optind + 1], "wb");
+    if (!output) {
+        std::perror(argv[optind + 1]);
+        return 1;
+    }
+    std::fputs(MARKER, output);
+    // The addresses wrap around every 64kB, the bootloader ignores them
+    for (size_t offset = 0; offset < image.size(); offset += RECORD_SIZE)
+        put_record(output, 0x00, offset & 0xFFFF, &image[offset],
+            RECORD_SIZE);
+    put_record(output, 0x01, 0, nullptr, 0);
+    long size = std::ftell(output);
+    std::fclose(output);
+    std::fprintf(stderr, "%zu bytes of data, %zu pages, %ld bytes of HEX\n",
+        image.size(), image.size() / page_size, size);
+    return 0;
+}
@@ -0,0 +1,269 @@
+/* reaDIYboot HEX decoding benchmark
+ * Copyright (C) 2011-2012 reaDIYmate
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Compare the speed of the HEX decoding of reaDIYboot with the branchy
+ * routine it replaced, on real HEX files. Both decoders are copies of the
+ * bootloader code, with the lookup table in RAM instead of PROGMEM; the tool
+ * checks that they produce the same binary image before timing them.
+ *
+ * The figures are those of the host CPU. The cycles spent by the bootloader
+ * itself are measured with pc_profile on an emulated run.
+ *
+ * Usage: ihex_bench [-n iterations] <HEX file>...
+ */
+#include <cctype>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <unistd.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define HAVE_RDTSC
+#endif
+
+namespace {
+
+/* Branchy decoder of the previous versions of reaDIYboot */
+namespace branchy {
+
+uint8_t ihex_parse_byte(const uint8_t* source)
+{
+    uint8_t byte_value;
+    uint8_t ch;
+
+    ch = source[0];
+    if (ch >= '0' && ch <= '9')
+        byte_value = ch - '0';
+    else if (ch >= 'A' && ch <= 'F')
+        byte_value = ch - 'A' + 10;
+    else
+        return 0;
+    byte_value <<= 4;
+    ch = source[1];
+    if (ch >= '0' && ch <= '9')
+        byte_value += ch - '0';
+    else if (ch >= 'A' && ch <= 'F')
+        byte_value += ch - 'A' + 10;
+    else
+        return 0;
+    return byte_value;
+}
+
+bool decode(uint8_t* text, size_t size, std::vector<uint8_t>& image)
+{
+    size_t index = 0;
+    while (index + 9 <= size) {
+        if (text[index] != ':')
+            return false;
+        uint8_t count = ihex_parse_byte(text + index + 1);
+        if (index + 13 + (count << 1) > size)
+            return false;
+        uint8_t record_type = ihex_parse_byte(text + index + 7);
+        index += 9;
+        if (record_type != 0x00)
+            index += count << 1;
+        else {
+            for (; count > 0; count--, index += 2)
+                image.push_back(ihex_parse_byte(text + index));
+        }
+        index += 4;
+    }
+    return true;
+}
+
+} // namespace branchy
+
+/* Table-driven decoder of reaDIYboot, with the checksum of each line */
+namespace table {
+
+/* Must match IHEX_DIGITS in reaDIYboot.c */
+const uint8_t IHEX_DIGITS[] = {
+    0, 1, 2, 3, 4, 5, 6, 7, 8, 9,
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+    10, 11, 12, 13, 14, 15,
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+    0xFF, 0xFF,
+    10, 11, 12, 13, 14, 15
+};
+
+uint8_t line_checksum;
+
+int16_t ihex_parse_byte(const uint8_t* source)
+{
+    uint8_t high = source[0] - '0';
+    uint8_t low = source[1] - '0';
+
+    if (high >= sizeof(IHEX_DIGITS) || low >= sizeof(IHEX_DIGITS))
+        return -1;
+    high = IHEX_DIGITS[high];
+    low = IHEX_DIGITS[low];
+    if ((high | low) & 0x80)
+        return -1;
+    low |= high << 4;
+    line_checksum += low;
+    return low;
+}
+
+bool decode(uint8_t* text, size_t size, std::vector<uint8_t>& image)
+{
+    size_t index = 0;
+    while (index + 9 <= size) {
+        uint8_t* line = text + index;
+        if (line[0] != ':')
+            return false;
+        line_checksum = 0;
+        int16_t value = ihex_parse_byte(line + 1);
+        if (value < 0)
+            return false;
+        uint8_t count = value;
+        if (index + 13 + (count << 1) > size)
+            return false;
+        if (ihex_parse_byte(line + 3) < 0 || ihex_parse_byte(line + 5) < 0)
+            return false;
+        value = ihex_parse_byte(line + 7);
+        if (value < 0)
+            return false;
+        uint8_t record_type = value;
+        line += 9;
+        for (uint8_t i = count; i > 0; i--) {
+            value = ihex_parse_byte(line + (i << 1) - 2);
+            if (value < 0)
+                return false;
+            line[count + i - 1] = value;
+        }
+        if (ihex_parse_byte(line + (count << 1)) < 0 || line_checksum != 0)
+            return false;
+        if (record_type == 0x00)
+            image.insert(image.end(), line + count, line + 2*count);
+        index += 13 + (count << 1);
+    }
+    return true;
+}
+
+} // namespace table
+
+typedef bool (*Decoder)(uint8_t*, size_t, std::vector<uint8_t>&);
+
+struct Result {
+    double seconds;
+    uint64_t cycles;
+};
+
+/* Decode a fresh copy of the file the given number of times */
+Result run(Decoder decode, const std::string& text, unsigned iterations,
+    std::vector<uint8_t>& image)
+{
+    Result result = {0, 0};
+    std::vector<uint8_t> copy(text.size());
+    for (unsigned i = 0; i < iterations; i++) {
+        std::memcpy(copy.data(), text.data(), text.size());
+        image.clear();
+        image.reserve(text.size() / 2);
+        auto start = std::chrono::steady_clock::now();
+#ifdef HAVE_RDTSC
+        uint64_t cycles = __rdtsc();
+#endif
+        decode(copy.data(), copy.size(), image);
+#ifdef HAVE_RDTSC
+        result.cycles += __rdtsc() - cycles;
+#endif
+        result.seconds += std::chrono::duration<double>(
+            std::chrono::steady_clock::now() - start).count();
+    }
+    return result;
+}
+
+void report(const char* name, const Result& result, size_t bytes)
+{
+    std::printf("  %-8s %8.1f MB/s", name, bytes / result.seconds / 1e6);
+#ifdef HAVE_RDTSC
+    std::printf("  %6.2f cycles/byte", double(result.cycles) / bytes);
+#endif
+    std::printf("\n");
+}
+
+} // namespace
+
+int main(int argc, char** argv)
+{
+    unsigned iterations = 200;
+    int option;
+    while ((option = getopt(argc, argv, "n:")) != -1) {
+        if (option == 'n')
+            iterations = std::strtoul(optarg, nullptr, 0);
+        else
+            return 2;
+    }
+    if (optind >= argc || iterations == 0) {
+        std::fprintf(stderr, "usage: %s [-n iterations] <HEX file>...\n",
+            argv[0]);
+        return 2;
+    }
+
+    int status = 0;
+    for (int i = optind; i < argc; i++) {
+        std::ifstream file(argv[i], std::ios::binary);
+        if (!file) {
+            std::perror(argv[i]);
+            return 1;
+        }
+        std::stringstream contents;
+        contents << file.rdbuf();
+        std::string text = contents.str();
+
+        std::vector<uint8_t> expected, image;
+        // The branchy decoder reads lowercase digits as 0
+        std::vector<uint8_t> copy(text.begin(), text.end());
+        for (uint8_t& ch : copy)
+            ch = std::toupper(ch);
+        branchy::decode(copy.data(), copy.size(), expected);
+        copy.assign(text.begin(), text.end());
+        if (!table::decode(copy.data(), copy.size(), image)) {
+            std::printf("%s: rejected by the table decoder, check the "
+                "checksums and the \"\\r\\n\" line endings\n", argv[i]);
+            status = 1;
+            continue;
+        }
+        if (image != expected) {
+            std::printf("%s: the decoders disagree\n", argv[i]);
+            status = 1;
+            continue;
+        }
+
+        std::printf("%s: %zu bytes of HEX, %zu bytes of data\n", argv[i],
+            text.size(), image.size());
+        // Warm up the caches before timing
+        run(branchy::decode, text, 1, image);
+        Result old_result = run(branchy::decode, text, iterations, image);
+        Result new_result = run(table::decode, text, iterations, image);
+        size_t bytes = text.size() * iterations;
+        report("branchy", old_result, bytes);
+        report("table", new_result, bytes);
+        std::printf("  speedup  %8.2fx\n",
+            old_result.seconds / new_result.seconds);
+    }
+    return status;
+}
@@ -0,0 +1,264 @@
+/* reaDIYboot page carousel
+ * Copyright (C) 2011-2012 reaDIYmate
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Broadcast a HEX file on the LAN, one Flash page per UDP packet, for the
+ * bootloaders built with UDP_PAGE_CAROUSEL. The pages are sent in order and
+ * the carousel starts over once the last one is sent, so that a board can
+ * join at any time.
+ *
+ * Each packet is made of text lines: a header record (type 0x53) holding the
+ * page index in its address field, then the number of pages and the CRC-16
+ * of the image, followed by the lines of the page exactly as hex_pack writes
+ * them. The pages missed by a board are downloaded from the HTTP server,
+ * which must host the output of hex_pack for the same HEX file.
+ *
+ * Usage: page_carousel [-a address] [-p port] [-i interval ms] [-r rounds]
+ *                      [-s page size] <HEX file>
+ */
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+namespace {
+
+/* Must match CAROUSEL_RECORD_TYPE and PACKED_RECORD_SIZE in reaDIYboot.c */
+const uint8_t HEADER_TYPE = 0x53;
+const unsigned RECORD_SIZE = 128;
+
+int hex_value(char c)
+{
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    if (c >= 'A' && c <= 'F')
+        return c - 'A' + 10;
+    if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    return -1;
+}
+
+bool parse_bytes(const std::string& text, std::vector<uint8_t>& bytes)
+{
+    if (text.size() % 2 != 0)
+        return false;
+    for (size_t i = 0; i < text.size(); i += 2) {
+        int high = hex_value(text[i]);
+        int low = hex_value(text[i + 1]);
+        if (high < 0 || low < 0)
+            return false;
+        bytes.push_back(high << 4 | low);
+    }
+    return true;
+}
+
+/* Load the data records of a HEX file into a binary image */
+bool load(const char* path, std::vector<uint8_t>& image)
+{
+    std::ifstream file(path);
+    if (!file) {
+        std::perror(path);
+        return false;
+    }
+    uint32_t base = 0;
+    std::string line;
+    unsigned number = 0;
+    while (std::getline(file, line)) {
+        ++number;
+        if (!line.empty() && line.back() == '\r')
+            line.pop_back();
+        if (line.empty())
+            continue;
+        std::vector<uint8_t> bytes;
+        if (line[0] != ':' || !parse_bytes(line.substr(1), bytes)
+            || bytes.size() < 5 || bytes.size() != bytes[0] + 5u) {
+            std::fprintf(stderr, "%s:%u: malformed line\n", path, number);
+            return false;
+        }
+        uint8_t sum = 0;
+        for (uint8_t byte : bytes)
+            sum += byte;
+        if (sum != 0) {
+            std::fprintf(stderr, "%s:%u: bad checksum\n", path, number);
+            return false;
+        }
+        uint16_t address = bytes[1] << 8 | bytes[2];
+        uint8_t type = bytes[3];
+        if (type == 0x00) {
+            uint32_t start = base + address;
+            if (image.size() < start + bytes[0])
+                image.resize(start + bytes[0], 0xFF);
+            for (unsigned i = 0; i < bytes[0]; i++)
+                image[start + i] = bytes[4 + i];
+        }
+        else if (type == 0x01)
+            break;
+        else if (type == 0x02)
+            base = (bytes[4] << 8 | bytes[5]) << 4;
+        else if (type == 0x04)
+            base = (bytes[4] << 8 | bytes[5]) << 16;
+        // The marker of the packed layout and the start address records are
+        // useless to the bootloader
+    }
+    return true;
+}
+
+void put_record(std::string& output, uint8_t type, uint16_t address,
+    const uint8_t* data, unsigned size)
+{
+    char text[16];
+    uint8_t sum = size + (address >> 8) + address + type;
+    std::snprintf(text, sizeof(text), ":%02X%04X%02X", size, address, type);
+    output += text;
+    for (unsigned i = 0; i < size; i++) {
+        std::snprintf(text, sizeof(text), "%02X", data[i]);
+        output += text;
+        sum += data[i];
+    }
+    std::snprintf(text, sizeof(text), "%02X\r\n", static_cast<uint8_t>(-sum));
+    output += text;
+}
+
+/* CRC-16 of the image, as computed by flash_crc16 in reaDIYboot.c */
+uint16_t crc16(const std::vector<uint8_t>& image)
+{
+    uint16_t crc = 0xFFFF;
+    for (uint8_t byte : image) {
+        crc ^= byte;
+        for (int bit = 0; bit < 8; bit++)
+            crc = crc & 1 ? (crc >> 1) ^ 0xA001 : crc >> 1;
+    }
+    return crc;
+}
+
+void usage(const char* program)
+{
+    std::fprintf(stderr,
+        "usage: %s [-a address] [-p port] [-i interval ms] [-r rounds]\n"
+        "       [-s page size] <HEX file>\n",
+        program);
+}
+
+} // namespace
+
+int main(int argc, char** argv)
+{
+    const char* destination = "255.255.255.255";
+    unsigned port = 2000;
+    unsigned interval = 80;
+    unsigned rounds = 0;
+    unsigned page_size = 256;
+    int option;
+    while ((option = getopt(argc, argv, "a:p:i:r:s:")) != -1) {
+        switch (option) {
+        case 'a':
+            destination = optarg;
+            break;
+        case 'p':
+            port = std::strtoul(optarg, nullptr, 0);
+            break;
+        case 'i':
+            interval = std::strtoul(optarg, nullptr, 0);
+            break;
+        case 'r':
+            rounds = std::strtoul(optarg, nullptr, 0);
+            break;
+        case 's':
+            page_size = std::strtoul(optarg, nullptr, 0);
+            break;
+        default:
+            usage(argv[0]);
+            return 2;
+        }
+    }
+    if (optind != argc - 1 || page_size == 0 || page_size % RECORD_SIZE) {
+        usage(argv[0]);
+        return 2;
+    }
+
+    std::vector<uint8_t> image;
+    if (!load(argv[optind], image))
+        return 1;
+    // Pad the last page like hex_pack does
+    image.resize((image.size() + page_size - 1) / page_size * page_size,
+        0xFF);
+    size_t count = image.size() / page_size;
+    if (count == 0 || count > 0xFFFF) {
+        std::fprintf(stderr, "%s: no data to send\n", argv[optind]);
+        return 1;
+    }
+    uint16_t crc = crc16(image);
+
+    std::vector<std::string> packets(count);
+    const uint8_t header[4] = {
+        uint8_t(count >> 8), uint8_t(count), uint8_t(crc >> 8), uint8_t(crc)
+    };
+    for (size_t page = 0; page < count; page++) {
+        put_record(packets[page], HEADER_TYPE, page, header, sizeof(header));
+        for (size_t offset = page * page_size;
+            offset < (page + 1) * page_size; offset += RECORD_SIZE)
+            put_record(packets[page], 0x00, offset & 0xFFFF, &image[offset],
+                RECORD_SIZE);
+    }
+
+    int sock = socket(AF_INET, SOCK_DGRAM, 0);
+    int enable = 1;
+    if (sock < 0
+        || setsockopt(sock, SOL_SOCKET, SO_BROADCAST, &enable, sizeof(enable))
+        < 0) {
+        std::perror("socket");
+        return 1;
+    }
+    sockaddr_in target = {};
+    target.sin_family = AF_INET;
+    target.sin_port = htons(port);
+    if (inet_pton(AF_INET, destination, &target.sin_addr) != 1) {
+        std::fprintf(stderr, "%s: invalid address\n", destination);
+        return 2;
+    }
+    std::fprintf(stderr, "%zu pages, CRC 0x%04X, %zu bytes per packet, "
+        "%.1f s per round\n", count, crc, packets[0].size(),
+        count * interval / 1000.0);
+
+    // Pace the packets so that the boards write each page before the next
+    // one reaches their UART
+    auto next = std::chrono::steady_clock::now();
+    for (unsigned round = 1; rounds == 0 || round <= rounds; round++) {
+        for (const std::string& packet : packets) {
+            std::this_thread::sleep_until(next);
+            next += std::chrono::milliseconds(interval);
+            if (sendto(sock, packet.data(), packet.size(), 0,
+                    reinterpret_cast<sockaddr*>(&target), sizeof(target))
+                < 0) {
+                std::perror("sendto");
+                return 1;
+            }
+        }
+        std::fprintf(stderr, "round %u sent\n", round);
+    }
+    close(sock);
+    return 0;
+}
@@ -0,0 +1,389 @@
+/* reaDIYboot cycle profiler
+ * Copyright (C) 2011-2012 reaDIYmate
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Attribute the CPU cycles of an emulated run of reaDIYboot to its functions
+ * and to the states of the internet bootloader state machine.
+ *
+ * The input is an instruction trace produced by an AVR emulator, with one
+ * line per executed instruction:
+ *
+ *     <cycle count> <program counter> [<value of boot_state>]
+ *
+ * The cycle count is decimal, the program counter is a hexadecimal byte
+ * address (use -w for word addresses). The optional third column is the
+ * byte stored at the address of boot_state, which the tool prints when run
+ * with -s. Lines starting with '#' are ignored.
+ *
+ * The call stack is rebuilt from the program counter: entering a function at
+ * its first instruction is a call, landing back in a function of the stack is
+ * a return. Local labels of the inline assembly (such as the wait_spm loops
+ * of write_bin_page) are reported as children of their function.
+ *
+ * Usage: pc_profile [-w] [-s] [-f folded.txt] [-l label] <elf> [trace]
+ */
+#include <algorithm>
+#include <cinttypes>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <elf.h>
+#include <unistd.h>
+
+namespace {
+
+/* Must match enum bootloader_state in reaDIYboot.c */
+const char* const BOOT_STATES[] = {
+    "ENTERING", "FILLING_BUFFER", "CHECKING_HEX_LINE", "PARSING_HEX_LINE",
+    "WRITING_BIN_PAGE", "EXITING", "JUMPING_TO_APP"
+};
+const unsigned BOOT_STATE_COUNT = 7;
+
+struct Symbol {
+    uint32_t start;
+    uint32_t end;
+    std::string name;
+};
+
+struct Image {
+    std::vector<Symbol> functions;
+    std::vector<Symbol> labels;
+    uint32_t boot_state_address = 0;
+    bool has_boot_state = false;
+};
+
+bool load_image(const char* path, Image& image)
+{
+    std::ifstream file(path, std::ios::binary);
+    if (!file) {
+        std::perror(path);
+        return false;
+    }
+    std::vector<char> data((std::istreambuf_iterator<char>(file)),
+        std::istreambuf_iterator<char>());
+    if (data.size() < sizeof(Elf32_Ehdr)
+        || std::memcmp(data.data(), ELFMAG, SELFMAG) != 0
+        || data[EI_CLASS] != ELFCLASS32) {
+        std::fprintf(stderr, "%s: not a 32-bit ELF file\n", path);
+        return false;
+    }
+    const Elf32_Ehdr* header =
+        reinterpret_cast<const Elf32_Ehdr*>(data.data());
+    if (header->e_machine != EM_AVR)
+        std::fprintf(stderr, "%s: warning: not an AVR image\n", path);
+    if (header->e_shoff + header->e_shnum * sizeof(Elf32_Shdr) > data.size()) {
+        std::fprintf(stderr, "%s: truncated section table\n", path);
+        return false;
+    }
+    const Elf32_Shdr* sections =
+        reinterpret_cast<const Elf32_Shdr*>(data.data() + header->e_shoff);
+
+    for (unsigned i = 0; i < header->e_shnum; i++) {
+        if (sections[i].sh_type != SHT_SYMTAB)
+            continue;
+        const Elf32_Shdr& strings = sections[sections[i].sh_link];
+        const Elf32_Sym* symbols = reinterpret_cast<const Elf32_Sym*>(
+            data.data() + sections[i].sh_offset);
+        unsigned count = sections[i].sh_size / sizeof(Elf32_Sym);
+        for (unsigned j = 0; j < count; j++) {
+            const Elf32_Sym& symbol = symbols[j];
+            if (symbol.st_name == 0 || symbol.st_shndx == SHN_UNDEF
+                || symbol.st_shndx >= header->e_shnum)
+                continue;
+            std::string name(data.data() + strings.sh_offset
+                + symbol.st_name);
+            unsigned type = ELF32_ST_TYPE(symbol.st_info);
+            bool text = sections[symbol.st_shndx].sh_flags & SHF_EXECINSTR;
+            if (type == STT_FUNC && text) {
+                image.functions.push_back({symbol.st_value,
+                    symbol.st_value + symbol.st_size, name});
+            }
+            else if (type == STT_NOTYPE && text && name[0] != '.'
+                && name.compare(0, 2, "__") != 0) {
+                image.labels.push_back({symbol.st_value, symbol.st_value,
+                    name});
+            }
+            else if (type == STT_OBJECT && name == "boot_state") {
+                // Data addresses are offset by 0x800000 in AVR images
+                image.boot_state_address = symbol.st_value & 0xFFFF;
+                image.has_boot_state = true;
+            }
+        }
+    }
+    auto by_start = [](const Symbol& a, const Symbol& b) {
+        return a.start < b.start;
+    };
+    std::sort(image.functions.begin(), image.functions.end(), by_start);
+    std::sort(image.labels.begin(), image.labels.end(), by_start);
+    // Functions without a size extend up to the next symbol
+    for (size_t i = 0; i < image.functions.size(); i++) {
+        Symbol& function = image.functions[i];
+        if (function.end == function.start)
+            function.end = (i + 1 < image.functions.size())
+                ? image.functions[i + 1].start : function.start + 2;
+    }
+    // A label extends up to the next label or the end of its function
+    for (size_t i = 0; i < image.labels.size(); i++)
+        image.labels[i].end = (i + 1 < image.labels.size())
+            ? image.labels[i + 1].start : image.labels[i].start + 2;
+    if (image.functions.empty()) {
+        std::fprintf(stderr, "%s: no function symbols\n", path);
+        return false;
+    }
+    return true;
+}
+
+const Symbol* find(const std::vector<Symbol>& symbols, uint32_t address)
+{
+    auto it = std::upper_bound(symbols.begin(), symbols.end(), address,
+        [](uint32_t value, const Symbol& symbol) {
+            return value < symbol.start;
+        });
+    if (it == symbols.begin())
+        return nullptr;
+    --it;
+    return (address < it->end) ? &*it : nullptr;
+}
+
+class Profiler {
+public:
+    explicit Profiler(const Image& image) : image_(image) {}
+    void step(uint64_t cycle, uint32_t pc, int state);
+    void finish();
+    void report(const std::string& label) const;
+    void write_folded(std::ostream& out) const;
+
+private:
+    void charge(uint64_t cycles);
+
+    const Image& image_;
+    std::vector<const Symbol*> stack_;
+    uint32_t pc_ = 0;
+    int state_ = -1;
+    uint64_t cycle_ = 0;
+    bool started_ = false;
+
+    std::map<std::string, uint64_t> folded_;
+    std::map<std::string, uint64_t> self_;
+    std::map<int, uint64_t> states_;
+    uint64_t total_ = 0;
+};
+
+void Profiler::step(uint64_t cycle, uint32_t pc, int state)
+{
+    if (started_ && cycle >= cycle_)
+        charge(cycle - cycle_);
+    started_ = true;
+    cycle_ = cycle;
+    pc_ = pc;
+    state_ = state;
+
+    const Symbol* function = find(image_.functions, pc);
+    if (function == nullptr) {
+        stack_.clear();
+        return;
+    }
+    if (!stack_.empty() && stack_.back() == function)
+        return;
+    if (pc == function->start) {
+        // Call
+        stack_.push_back(function);
+        return;
+    }
+    auto it = std::find(stack_.rbegin(), stack_.rend(), function);
+    if (it != stack_.rend()) {
+        // Return to a caller
+        stack_.erase(it.base(), stack_.end());
+    }
+    else if (!stack_.empty()) {
+        // Jump into another function
+        stack_.back() = function;
+    }
+    else {
+        stack_.push_back(function);
+    }
+}
+
+void Profiler::finish()
+{
+    // The last instruction takes at least one cycle
+    if (started_)
+        charge(1);
+    started_ = false;
+}
+
+void Profiler::charge(uint64_t cycles)
+{
+    std::string path;
+    if (state_ >= 0) {
+        path = (state_ < static_cast<int>(BOOT_STATE_COUNT))
+            ? BOOT_STATES[state_] : "state " + std::to_string(state_);
+    }
+    std::string leaf = "(unknown)";
+    for (const Symbol* function : stack_) {
+        if (!path.empty())
+            path += ';';
+        path += function->name;
+    }
+    if (!stack_.empty()) {
+        leaf = stack_.back()->name;
+        const Symbol* label = find(image_.labels, pc_);
+        if (label != nullptr && label->start >= stack_.back()->start
+            && label->start < stack_.back()->end) {
+            path += ';' + label->name;
+            leaf += ':' + label->name;
+        }
+    }
+    else {
+        path += path.empty() ? leaf : ';' + leaf;
+    }
+    folded_[path] += cycles;
+    self_[leaf] += cycles;
+    states_[state_] += cycles;
+    total_ += cycles;
+}
+
+void Profiler::report(const std::string& label) const
+{
+    if (!label.empty())
+        std::printf("run: %s\n", label.c_str());
+    std::printf("total: %" PRIu64 " cycles\n\n", total_);
+
+    std::vector<std::pair<uint64_t, std::string>> rows;
+    for (const auto& entry : self_)
+        rows.push_back({entry.second, entry.first});
+    std::sort(rows.rbegin(), rows.rend());
+    std::printf("%14s %7s  %s\n", "self cycles", "share", "function");
+    for (const auto& row : rows)
+        std::printf("%14" PRIu64 " %6.2f%%  %s\n", row.first,
+            total_ ? 100.0 * row.first / total_ : 0.0, row.second.c_str());
+
+    if (states_.size() > 1 || states_.count(-1) == 0) {
+        std::printf("\n%14s %7s  %s\n", "cycles", "share", "boot_state");
+        for (const auto& entry : states_) {
+            std::string name = "(unknown)";
+            if (entry.first >= 0)
+                name = (entry.first < static_cast<int>(BOOT_STATE_COUNT))
+                    ? BOOT_STATES[entry.first]
+                    : "state " + std::to_string(entry.first);
+            std::printf("%14" PRIu64 " %6.2f%%  %s\n", entry.second,
+                total_ ? 100.0 * entry.second / total_ : 0.0, name.c_str());
+        }
+    }
+}
+
+void Profiler::write_folded(std::ostream& out) const
+{
+    for (const auto& entry : folded_)
+        out << entry.first << ' ' << entry.second << '\n';
+}
+
+void usage(const char* program)
+{
+    std::fprintf(stderr, "usage: %s [-w] [-s] [-f folded.txt] [-l label] "
+        "<elf> [trace]\n", program);
+}
+
+} // namespace
+
+int main(int argc, char** argv)
+{
+    bool word_addresses = false;
+    bool show_symbol = false;
+    const char* folded_path = nullptr;
+    std::string label;
+    int option;
+    while ((option = getopt(argc, argv, "wsf:l:")) != -1) {
+        if (option == 'w')
+            word_addresses = true;
+        else if (option == 's')
+            show_symbol = true;
+        else if (option == 'f')
+            folded_path = optarg;
+        else if (option == 'l')
+            label = optarg;
+        else {
+            usage(argv[0]);
+            return 2;
+        }
+    }
+    if (optind >= argc || argc - optind > 2) {
+        usage(argv[0]);
+        return 2;
+    }
+
+    Image image;
+    if (!load_image(argv[optind], image))
+        return 1;
+    if (show_symbol) {
+        if (!image.has_boot_state) {
+            std::fprintf(stderr, "boot_state not found in the image\n");
+            return 1;
+        }
+        std::printf("boot_state: 0x%04x\n", image.boot_state_address);
+        return 0;
+    }
+
+    std::ifstream file;
+    std::istream* input = &std::cin;
+    if (argc - optind == 2) {
+        file.open(argv[optind + 1]);
+        if (!file) {
+            std::perror(argv[optind + 1]);
+            return 1;
+        }
+        input = &file;
+    }
+
+    Profiler profiler(image);
+    std::string line;
+    while (std::getline(*input, line)) {
+        if (line.empty() || line[0] == '#')
+            continue;
+        std::istringstream fields(line);
+        uint64_t cycle;
+        std::string pc_text;
+        int state = -1;
+        if (!(fields >> cycle >> pc_text))
+            continue;
+        fields >> state;
+        uint32_t pc = std::strtoul(pc_text.c_str(), nullptr, 16);
+        if (word_addresses)
+            pc <<= 1;
+        profiler.step(cycle, pc, state);
+    }
+    profiler.finish();
+    profiler.report(label);
+
+    if (folded_path != nullptr) {
+        std::ofstream folded(folded_path);
+        if (!folded) {
+            std::perror(folded_path);
+            return 1;
+        }
+        profiler.write_folded(folded);
+    }
+    return 0;
+}
@@ -0,0 +1,421 @@
+/* reaDIYboot STK verification
+ * Copyright (C) 2011-2012 reaDIYmate
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Verify the Flash memory of a board against a HEX file over the STK500v1
+ * protocol, after an upload with "avrdude -V". With a bootloader built with
+ * STK_CRC_EXTENSION, the board computes the CRC-32 of each block of 4kB of
+ * the HEX file, and only the blocks whose CRC differs are read back byte by
+ * byte to find the first difference. Other bootloaders are read back
+ * entirely, like avrdude does.
+ *
+ * The board is reset through DTR and RTS, unless -n is given, and starts the
+ * application once the verification is over.
+ *
+ * Usage: stk_verify [-b baud] [-n] [-r] <serial device> <HEX file>
+ */
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/ioctl.h>
+#include <termios.h>
+#include <unistd.h>
+
+namespace {
+
+/* Must match the STK500 constants in reaDIYboot.c */
+const uint8_t STK_GET_SYNC = 0x30;
+const uint8_t STK_GET_PARAMETER = 0x41;
+const uint8_t STK_LEAVE_PROGMODE = 0x51;
+const uint8_t STK_LOAD_ADDRESS = 0x55;
+const uint8_t STK_UNIVERSAL = 0x56;
+const uint8_t STK_READ_PAGE = 0x74;
+const uint8_t STK_READ_CRC32 = 0x7C;
+const uint8_t STK_EXTENSIONS = 0xE0;
+const uint8_t STK_LOAD_EXTENDED_ADDRESS = 0x4D;
+const uint8_t STK_CRC_EOP = 0x20;
+const uint8_t STK_INSYNC = 0x14;
+const uint8_t STK_OK = 0x10;
+/* Bit 7 of the extensions tells them from a top-card, bit 0 is CRC-32 */
+const uint8_t EXTENSION_MARKER = 0x80;
+const uint8_t EXTENSION_CRC32 = 0x01;
+
+/* Bytes read back per STK_READ_PAGE command */
+const unsigned READ_BLOCK_SIZE = 256;
+/* Largest block checked with a single CRC */
+const size_t CRC_BLOCK_SIZE = 4096;
+/* Timeout of a response, the CRC being given more time per byte */
+const int RESPONSE_TIMEOUT_MS = 500;
+const double CRC_MS_PER_KB = 10;
+
+struct Block {
+    uint32_t address;
+    std::vector<uint8_t> data;
+};
+
+speed_t baud_constant(long baud)
+{
+    switch (baud) {
+        case 9600: return B9600;
+        case 19200: return B19200;
+        case 38400: return B38400;
+        case 57600: return B57600;
+        case 115200: return B115200;
+        default: return B0;
+    }
+}
+
+bool configure_tty(int fd, long baud)
+{
+    struct termios tio;
+    if (tcgetattr(fd, &tio) != 0)
+        return false;
+    cfmakeraw(&tio);
+    speed_t speed = baud_constant(baud);
+    if (speed == B0) {
+        std::fprintf(stderr, "unsupported baud rate %ld\n", baud);
+        return false;
+    }
+    cfsetispeed(&tio, speed);
+    cfsetospeed(&tio, speed);
+    tio.c_cc[VMIN] = 1;
+    tio.c_cc[VTIME] = 0;
+    return tcsetattr(fd, TCSANOW, &tio) == 0;
+}
+
+int hex_value(char c)
+{
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    if (c >= 'A' && c <= 'F')
+        return c - 'A' + 10;
+    if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    return -1;
+}
+
+bool parse_bytes(const std::string& text, std::vector<uint8_t>& bytes)
+{
+    if (text.size() % 2 != 0)
+        return false;
+    for (size_t i = 0; i < text.size(); i += 2) {
+        int high = hex_value(text[i]);
+        int low = hex_value(text[i + 1]);
+        if (high < 0 || low < 0)
+            return false;
+        bytes.push_back(high << 4 | low);
+    }
+    return true;
+}
+
+/* Load the data records of a HEX file as blocks of contiguous bytes */
+bool load(const char* path, std::vector<Block>& blocks)
+{
+    std::ifstream file(path);
+    if (!file) {
+        std::perror(path);
+        return false;
+    }
+    uint32_t base = 0;
+    std::string line;
+    unsigned number = 0;
+    while (std::getline(file, line)) {
+        ++number;
+        if (!line.empty() && line.back() == '\r')
+            line.pop_back();
+        if (line.empty())
+            continue;
+        std::vector<uint8_t> bytes;
+        if (line[0] != ':' || !parse_bytes(line.substr(1), bytes)
+            || bytes.size() < 5 || bytes.size() != bytes[0] + 5u) {
+            std::fprintf(stderr, "%s:%u: malformed line\n", path, number);
+            return false;
+        }
+        uint8_t sum = 0;
+        for (uint8_t byte : bytes)
+            sum += byte;
+        if (sum != 0) {
+            std::fprintf(stderr, "%s:%u: bad checksum\n", path, number);
+            return false;
+        }
+        uint16_t address = bytes[1] << 8 | bytes[2];
+        uint8_t type = bytes[3];
+        if (type == 0x00 && bytes[0] != 0) {
+            uint32_t start = base + address;
+            for (size_t i = 4; i < bytes.size() - 1; i++, start++) {
+                if (blocks.empty() || blocks.back().address
+                    + blocks.back().data.size() != start
+                    || blocks.back().data.size() == CRC_BLOCK_SIZE)
+                    blocks.push_back(Block{start, {}});
+                blocks.back().data.push_back(bytes[i]);
+            }
+        }
+        else if (type == 0x01)
+            break;
+        else if (type == 0x02)
+            base = (bytes[4] << 8 | bytes[5]) << 4;
+        else if (type == 0x04)
+            base = (bytes[4] << 8 | bytes[5]) << 16;
+    }
+    return true;
+}
+
+/* CRC-32 of a block, as computed by flash_crc32 in reaDIYboot.c */
+uint32_t crc32(const uint8_t* data, size_t size)
+{
+    uint32_t crc = 0xFFFFFFFF;
+    for (size_t i = 0; i < size; i++) {
+        crc ^= data[i];
+        for (int bit = 0; bit < 8; bit++)
+            crc = crc & 1 ? (crc >> 1) ^ 0xEDB88320 : crc >> 1;
+    }
+    return ~crc;
+}
+
+class Programmer {
+public:
+    explicit Programmer(int fd) : fd_(fd) {}
+
+    /* Pulse DTR and RTS low, like the auto-reset of the Arduino boards */
+    void reset()
+    {
+        int lines = TIOCM_DTR | TIOCM_RTS;
+        ioctl(fd_, TIOCMBIC, &lines);
+        std::this_thread::sleep_for(std::chrono::milliseconds(250));
+        ioctl(fd_, TIOCMBIS, &lines);
+        std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    }
+
+    bool sync()
+    {
+        for (int attempt = 0; attempt < 10; attempt++) {
+            tcflush(fd_, TCIFLUSH);
+            if (command({STK_GET_SYNC, STK_CRC_EOP}, nullptr, 0, 200))
+                return true;
+        }
+        return false;
+    }
+
+    bool get_parameter(uint8_t parameter, uint8_t& value)
+    {
+        return command({STK_GET_PARAMETER, parameter, STK_CRC_EOP}, &value, 1);
+    }
+
+    /* Load a byte address, the STK addresses being word addresses */
+    bool load_address(uint32_t address)
+    {
+        uint8_t ignored;
+        uint32_t word = address >> 1;
+        return command({STK_UNIVERSAL, STK_LOAD_EXTENDED_ADDRESS, 0x00,
+                uint8_t(word >> 16), 0x00, STK_CRC_EOP}, &ignored, 1)
+            && command({STK_LOAD_ADDRESS, uint8_t(word), uint8_t(word >> 8),
+                STK_CRC_EOP}, nullptr, 0);
+    }
+
+    bool read_crc32(uint32_t address, uint32_t size, uint32_t& crc)
+    {
+        uint8_t bytes[4];
+        int timeout = RESPONSE_TIMEOUT_MS + int(size / 1024.0 * CRC_MS_PER_KB);
+        if (!load_address(address)
+            || !command({STK_READ_CRC32, uint8_t(size >> 24),
+                uint8_t(size >> 16), uint8_t(size >> 8), uint8_t(size),
+                STK_CRC_EOP}, bytes, sizeof(bytes), timeout))
+            return false;
+        crc = bytes[0] | bytes[1] << 8 | bytes[2] << 16 | uint32_t(bytes[3])
+            << 24;
+        return true;
+    }
+
+    bool read(uint32_t address, uint8_t* data, unsigned size)
+    {
+        return load_address(address)
+            && command({STK_READ_PAGE, uint8_t(size >> 8), uint8_t(size), 'F',
+                STK_CRC_EOP}, data, size);
+    }
+
+    bool leave()
+    {
+        return command({STK_LEAVE_PROGMODE, STK_CRC_EOP}, nullptr, 0);
+    }
+
+private:
+    /* Send a command, then read STK_INSYNC, the response and STK_OK */
+    bool command(const std::vector<uint8_t>& request, uint8_t* response,
+        size_t size, int timeout = RESPONSE_TIMEOUT_MS)
+    {
+        if (write(fd_, request.data(), request.size())
+            != ssize_t(request.size()))
+            return false;
+        uint8_t byte;
+        if (!read_byte(byte, timeout) || byte != STK_INSYNC)
+            return false;
+        for (size_t i = 0; i < size; i++) {
+            if (!read_byte(response[i], timeout))
+                return false;
+        }
+        return read_byte(byte, timeout) && byte == STK_OK;
+    }
+
+    bool read_byte(uint8_t& byte, int timeout)
+    {
+        pollfd event = {fd_, POLLIN, 0};
+        return poll(&event, 1, timeout) == 1 && ::read(fd_, &byte, 1) == 1;
+    }
+
+    int fd_;
+};
+
+/* Read a block back and report its first difference, false on an error */
+bool compare(Programmer& programmer, const Block& block, bool& same,
+    size_t& read)
+{
+    std::vector<uint8_t> data(READ_BLOCK_SIZE);
+    same = true;
+    for (size_t offset = 0; offset < block.data.size();
+        offset += READ_BLOCK_SIZE) {
+        unsigned size = std::min<size_t>(READ_BLOCK_SIZE,
+            block.data.size() - offset);
+        if (!programmer.read(block.address + offset, data.data(), size))
+            return false;
+        read += size;
+        for (unsigned i = 0; i < size; i++) {
+            if (data[i] != block.data[offset + i]) {
+                std::printf("0x%05zX: 0x%02X in Flash, 0x%02X in the file\n",
+                    block.address + offset + i, data[i],
+                    block.data[offset + i]);
+                same = false;
+                return true;
+            }
+        }
+    }
+    return true;
+}
+
+void usage(const char* program)
+{
+    std::fprintf(stderr,
+        "usage: %s [-b baud] [-n] [-r] <serial device> <HEX file>\n",
+        program);
+}
+
+} // namespace
+
+int main(int argc, char** argv)
+{
+    long baud = 57600;
+    bool reset = true;
+    bool read_back = false;
+    int option;
+    while ((option = getopt(argc, argv, "b:nr")) != -1) {
+        switch (option) {
+        case 'b':
+            baud = std::strtol(optarg, nullptr, 0);
+            break;
+        case 'n':
+            reset = false;
+            break;
+        case 'r':
+            read_back = true;
+            break;
+        default:
+            usage(argv[0]);
+            return 2;
+        }
+    }
+    if (optind != argc - 2) {
+        usage(argv[0]);
+        return 2;
+    }
+
+    std::vector<Block> blocks;
+    if (!load(argv[optind + 1], blocks))
+        return 1;
+    int fd = open(argv[optind], O_RDWR | O_NOCTTY);
+    if (fd < 0) {
+        std::perror(argv[optind]);
+        return 1;
+    }
+    if (!configure_tty(fd, baud)) {
+        std::fprintf(stderr, "%s: cannot configure the port\n", argv[optind]);
+        return 1;
+    }
+    Programmer programmer(fd);
+    if (reset)
+        programmer.reset();
+    if (!programmer.sync()) {
+        std::fprintf(stderr, "%s: no answer from the bootloader\n",
+            argv[optind]);
+        return 1;
+    }
+    // Older bootloaders answer with the "no top-card" value
+    uint8_t extensions = 0;
+    if (!programmer.get_parameter(STK_EXTENSIONS, extensions)
+        || !(extensions & EXTENSION_MARKER))
+        extensions = 0;
+    bool use_crc = (extensions & EXTENSION_CRC32) && !read_back;
+    if (!use_crc && !read_back)
+        std::fprintf(stderr, "the bootloader can't compute CRCs, reading "
+            "the Flash memory back\n");
+
+    auto start = std::chrono::steady_clock::now();
+    int status = 0;
+    size_t total = 0;
+    size_t read = 0;
+    for (const Block& block : blocks) {
+        total += block.data.size();
+        if (use_crc) {
+            uint32_t crc;
+            if (!programmer.read_crc32(block.address, block.data.size(),
+                crc)) {
+                std::fprintf(stderr, "0x%05X: no CRC from the bootloader\n",
+                    block.address);
+                return 1;
+            }
+            if (crc == crc32(block.data.data(), block.data.size()))
+                continue;
+            std::printf("0x%05X-0x%05zX: CRC 0x%08X in Flash, 0x%08X in the "
+                "file\n", block.address,
+                block.address + block.data.size() - 1, crc,
+                crc32(block.data.data(), block.data.size()));
+        }
+        bool same;
+        if (!compare(programmer, block, same, read)) {
+            std::fprintf(stderr, "0x%05X: read error\n", block.address);
+            return 1;
+        }
+        if (!same)
+            status = 1;
+    }
+    double seconds = std::chrono::duration<double>(
+        std::chrono::steady_clock::now() - start).count();
+    std::printf("%s: %zu bytes in %zu blocks %s, %zu bytes read back, "
+        "%.2f s\n", argv[optind + 1], total, blocks.size(),
+        status == 0 ? "verified" : "differ", read, seconds);
+    // Start the application
+    programmer.leave();
+    close(fd);
+    return status;
+}
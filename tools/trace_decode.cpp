@@ -0,0 +1,303 @@
+/* reaDIYboot trace decoder
+ * Copyright (C) 2011-2012 reaDIYmate
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Decode the binary trace sent by reaDIYboot on UART0 when it is built with
+ * ENABLE_UART_TRACE, and print it as a timeline.
+ *
+ * Usage: trace_decode [-b baud] <serial device or capture file>
+ */
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <iterator>
+#include <string>
+
+#include <fcntl.h>
+#include <termios.h>
+#include <unistd.h>
+
+namespace {
+
+/* Must match enum trace_type in reaDIYboot.c */
+enum TraceType {
+    TRACE_BOOT_STATE,
+    TRACE_WIFLY_STATE,
+    TRACE_DOWNLOAD_STATE,
+    TRACE_BYTES_RECEIVED,
+    TRACE_TIMEOUT,
+    TRACE_PAGE_WRITTEN,
+    TRACE_EVENTS_DROPPED
+};
+
+const char* const BOOT_STATES[] = {
+    "ENTERING", "FILLING_BUFFER", "CHECKING_HEX_LINE", "PARSING_HEX_LINE",
+    "WRITING_BIN_PAGE", "EXITING", "JUMPING_TO_APP"
+};
+const char* const WIFLY_STATES[] = {
+    "RESETTING", "SETTING_HOST", "JOINING_WLAN", "RESOLVING_HOST",
+    "OPENING_SOCKET", "WIFLY_CRITICAL_ERROR"
+};
+const char* const DOWNLOAD_STATES[] = {
+    "CHECKING_SOCKET", "SENDING_REQUEST", "RECEIVING_RESPONSE", "HTTP_ERROR",
+    "DOWNLOAD_CRITICAL_ERROR"
+};
+
+const unsigned EVENT_SIZE = 6;
+const char HEADER[] = "RDBT";
+/* Duration of a Timer/Counter3 period in microseconds */
+const double TICK_US = 64.0;
+/* Size of a Flash page in bytes (ATmega1280 and ATmega2560) */
+const unsigned FLASH_PAGE_SIZE = 256;
+
+speed_t baud_constant(long baud)
+{
+    switch (baud) {
+        case 9600: return B9600;
+        case 19200: return B19200;
+        case 38400: return B38400;
+        case 57600: return B57600;
+        case 115200: return B115200;
+        case 230400: return B230400;
+        default: return B0;
+    }
+}
+
+bool configure_tty(int fd, long baud)
+{
+    struct termios tio;
+    if (tcgetattr(fd, &tio) != 0)
+        return false;
+    cfmakeraw(&tio);
+    speed_t speed = baud_constant(baud);
+    if (speed == B0) {
+        std::fprintf(stderr, "unsupported baud rate %ld\n", baud);
+        return false;
+    }
+    cfsetispeed(&tio, speed);
+    cfsetospeed(&tio, speed);
+    tio.c_cc[VMIN] = 1;
+    tio.c_cc[VTIME] = 0;
+    return tcsetattr(fd, TCSANOW, &tio) == 0;
+}
+
+std::string state_name(const char* const* names, unsigned count,
+    unsigned value)
+{
+    if (value < count)
+        return names[value];
+    return "state " + std::to_string(value);
+}
+
+const char* timeout_name(unsigned channel)
+{
+    // OCF3A, OCF3B and OCF3C
+    switch (channel) {
+        case 1: return "UART";
+        case 2: return "WLAN";
+        case 3: return "HTTP";
+        default: return "unknown";
+    }
+}
+
+class Decoder {
+public:
+    void feed(uint8_t byte);
+
+private:
+    void start();
+    void decode();
+    void summarize();
+
+    bool synced_ = false;
+    unsigned header_index_ = 0;
+    uint8_t event_[EVENT_SIZE];
+    unsigned event_index_ = 0;
+
+    uint32_t last_raw_ = 0;
+    uint64_t epoch_ = 0;
+    uint64_t previous_ = 0;
+
+    unsigned long bytes_ = 0;
+    unsigned pages_ = 0;
+    unsigned timeouts_[4] = {0, 0, 0, 0};
+    unsigned dropped_ = 0;
+    unsigned resyncs_ = 0;
+};
+
+void Decoder::feed(uint8_t byte)
+{
+    // A new header means the board has rebooted
+    if (byte == static_cast<uint8_t>(HEADER[header_index_])) {
+        if (++header_index_ == sizeof(HEADER) - 1) {
+            header_index_ = 0;
+            if (synced_)
+                summarize();
+            start();
+            return;
+        }
+    }
+    else {
+        header_index_ = (byte == static_cast<uint8_t>(HEADER[0])) ? 1 : 0;
+    }
+    if (!synced_)
+        return;
+    if (event_index_ == 0 && (byte & 0xF0) != 0xA0) {
+        // Lost track of the record boundaries, skip to the next type byte
+        ++resyncs_;
+        return;
+    }
+    event_[event_index_++] = byte;
+    if (event_index_ == EVENT_SIZE) {
+        event_index_ = 0;
+        decode();
+    }
+}
+
+void Decoder::start()
+{
+    *this = Decoder();
+    synced_ = true;
+    std::printf("%12s %10s  %-9s %s\n", "time (ms)", "delta", "machine",
+        "event");
+}
+
+void Decoder::decode()
+{
+    unsigned type = event_[0] & 0x0F;
+    uint32_t raw = event_[1] | (event_[2] << 8) | (event_[3] << 16);
+    unsigned argument = event_[4] | (event_[5] << 8);
+
+    // Unwrap the 24-bit timestamp
+    if (raw < last_raw_)
+        epoch_ += 1UL << 24;
+    last_raw_ = raw;
+    uint64_t ticks = epoch_ + raw;
+    double time_ms = ticks * TICK_US / 1000.0;
+    double delta_ms = (ticks - previous_) * TICK_US / 1000.0;
+    previous_ = ticks;
+
+    std::string machine;
+    std::string text;
+    switch (type) {
+        case TRACE_BOOT_STATE:
+            machine = "boot";
+            text = state_name(BOOT_STATES, std::size(BOOT_STATES), argument);
+            break;
+        case TRACE_WIFLY_STATE:
+            machine = "wifly";
+            text = state_name(WIFLY_STATES, std::size(WIFLY_STATES), argument);
+            break;
+        case TRACE_DOWNLOAD_STATE:
+            machine = "download";
+            text = state_name(DOWNLOAD_STATES,
+                std::size(DOWNLOAD_STATES), argument);
+            break;
+        case TRACE_BYTES_RECEIVED:
+            machine = "download";
+            text = std::to_string(argument) + " bytes received";
+            bytes_ += argument;
+            break;
+        case TRACE_TIMEOUT:
+            machine = "timer";
+            text = std::string(timeout_name(argument)) + " timeout";
+            ++timeouts_[argument & 0x03];
+            break;
+        case TRACE_PAGE_WRITTEN:
+            machine = "flash";
+            char page[32];
+            std::snprintf(page, sizeof(page), "page %u written at 0x%05x",
+                argument, argument * FLASH_PAGE_SIZE);
+            text = page;
+            ++pages_;
+            break;
+        case TRACE_EVENTS_DROPPED:
+            machine = "trace";
+            text = std::to_string(argument) + " events dropped";
+            dropped_ += argument;
+            break;
+        default:
+            machine = "?";
+            text = "unknown event " + std::to_string(type);
+            break;
+    }
+    std::printf("%12.3f %+10.3f  %-9s %s\n", time_ms, delta_ms,
+        machine.c_str(), text.c_str());
+
+    if (type == TRACE_BOOT_STATE && argument == 6)
+        summarize();
+}
+
+void Decoder::summarize()
+{
+    double seconds = previous_ * TICK_US / 1e6;
+    std::printf("-- %.3f s, %lu HEX bytes", seconds, bytes_);
+    if (seconds > 0)
+        std::printf(" (%.0f B/s)", bytes_ / seconds);
+    std::printf(", %u pages, timeouts UART %u WLAN %u HTTP %u",
+        pages_, timeouts_[1], timeouts_[2], timeouts_[3]);
+    if (dropped_ > 0 || resyncs_ > 0)
+        std::printf(", %u events dropped, %u bytes skipped", dropped_,
+            resyncs_);
+    std::printf("\n");
+    std::fflush(stdout);
+    synced_ = false;
+}
+
+} // namespace
+
+int main(int argc, char** argv)
+{
+    long baud = 57600;
+    int option;
+    while ((option = getopt(argc, argv, "b:")) != -1) {
+        if (option == 'b')
+            baud = std::strtol(optarg, nullptr, 10);
+        else {
+            std::fprintf(stderr,
+                "usage: %s [-b baud] <serial device or capture file>\n",
+                argv[0]);
+            return 2;
+        }
+    }
+    if (optind != argc - 1) {
+        std::fprintf(stderr,
+            "usage: %s [-b baud] <serial device or capture file>\n", argv[0]);
+        return 2;
+    }
+
+    int fd = open(argv[optind], O_RDONLY | O_NOCTTY);
+    if (fd < 0) {
+        std::perror(argv[optind]);
+        return 1;
+    }
+    if (isatty(fd) && !configure_tty(fd, baud)) {
+        std::perror("tcsetattr");
+        return 1;
+    }
+
+    Decoder decoder;
+    uint8_t buffer[256];
+    ssize_t count;
+    while ((count = read(fd, buffer, sizeof(buffer))) > 0) {
+        for (ssize_t i = 0; i < count; i++)
+            decoder.feed(buffer[i]);
+    }
+    close(fd);
+    return 0;
+}
@@ -0,0 +1,593 @@
+/* reaDIYboot reference update server
+ * Copyright (C) 2011-2012 reaDIYmate
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Serve a HEX file the way reaDIYboot expects it: status and clear-status API
+ * calls, URL indirection in the status response, the update manifest, HEAD,
+ * single and multiple Range requests and ETags. The latency and the bandwidth of each connection
+ * can be limited, and every request is logged with its timings.
+ *
+ * Usage: update_server [options] <HEX file>
+ */
+#include <algorithm>
+#include <cctype>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <map>
+#include <mutex>
+#include <set>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <unistd.h>
+
+namespace {
+
+using Clock = std::chrono::steady_clock;
+
+/* Size of the blocks sent when the bandwidth is limited */
+const size_t THROTTLE_BLOCK = 256;
+/* Boundary of the multipart/byteranges responses */
+const char BOUNDARY[] = "READIYBOOT_BYTERANGES";
+/* Idle time after which a persistent connection is closed, in seconds */
+const int IDLE_TIMEOUT = 30;
+/* Must match PACKED_HEX_MARKER in reaDIYboot.c */
+const char PACKED_HEX_MARKER[] = ":080000525244425950414B3168\r\n";
+
+struct Options {
+    int port = 8080;
+    std::string image_path;
+    std::string status_path = "/status";
+    std::string clear_path = "/clear";
+    std::string manifest_path = "/manifest";
+    std::string expected = "\"status\":1";
+    std::string json_prefix = "\"path\":\"";
+    bool pending = true;
+    long latency_ms = 0;
+    long bandwidth = 0;
+    bool verbose = false;
+};
+
+struct Request {
+    std::string method;
+    std::string target;
+    std::string path;
+    std::string query;
+    std::map<std::string, std::string> headers;
+};
+
+struct Response {
+    int status = 200;
+    std::vector<std::pair<std::string, std::string>> headers;
+    std::string body;
+    // Send the headers of the body without the body itself (HEAD)
+    bool head_only = false;
+};
+
+Options options;
+std::string image;
+std::string etag;
+/* CRC-16 of the binary image, as computed by reaDIYboot */
+uint16_t image_crc;
+std::mutex state_mutex;
+/* Devices which have cleared their update status */
+std::set<std::string> cleared;
+std::mutex log_mutex;
+
+std::string lowercase(std::string text)
+{
+    std::transform(text.begin(), text.end(), text.begin(),
+        [](unsigned char c) { return std::tolower(c); });
+    return text;
+}
+
+std::string trim(const std::string& text)
+{
+    size_t first = text.find_first_not_of(" \t");
+    if (first == std::string::npos)
+        return "";
+    size_t last = text.find_last_not_of(" \t\r");
+    return text.substr(first, last - first + 1);
+}
+
+/* 64-bit FNV-1a hash, used as a strong ETag */
+std::string content_etag(const std::string& content)
+{
+    uint64_t hash = 0xcbf29ce484222325ULL;
+    for (unsigned char c : content) {
+        hash ^= c;
+        hash *= 0x100000001b3ULL;
+    }
+    char text[24];
+    std::snprintf(text, sizeof(text), "\"%016llx\"",
+        static_cast<unsigned long long>(hash));
+    return text;
+}
+
+/* Value of a query parameter, or an empty string */
+std::string query_value(const std::string& query, const std::string& key)
+{
+    std::istringstream stream(query);
+    std::string pair;
+    while (std::getline(stream, pair, '&')) {
+        size_t equal = pair.find('=');
+        if (equal != std::string::npos && pair.substr(0, equal) == key)
+            return pair.substr(equal + 1);
+    }
+    return "";
+}
+
+/*
+ * The bootloader appends the device ID right after the request configured in
+ * the makefile, so the ID is either the "id" parameter or whatever follows
+ * the API path.
+ */
+std::string device_id(const Request& request, const std::string& api_path)
+{
+    std::string id = query_value(request.query, "id");
+    if (!id.empty())
+        return id;
+    std::string rest = request.target.substr(api_path.size());
+    return rest.substr(0, rest.find_first_of("?&"));
+}
+
+bool starts_with(const std::string& text, const std::string& prefix)
+{
+    return text.compare(0, prefix.size(), prefix) == 0;
+}
+
+/*
+ * Parse a "bytes=a-b,c-,-d" Range header into inclusive intervals. Returns
+ * false if the header is malformed, and an empty list if no interval can be
+ * satisfied.
+ */
+bool parse_ranges(const std::string& header, size_t size,
+    std::vector<std::pair<size_t, size_t>>& ranges)
+{
+    if (!starts_with(header, "bytes="))
+        return false;
+    std::istringstream stream(header.substr(6));
+    std::string spec;
+    while (std::getline(stream, spec, ',')) {
+        spec = trim(spec);
+        size_t dash = spec.find('-');
+        if (dash == std::string::npos)
+            return false;
+        std::string first = spec.substr(0, dash);
+        std::string last = spec.substr(dash + 1);
+        if (first.empty() && last.empty())
+            return false;
+        size_t start, stop;
+        if (first.empty()) {
+            // Suffix range: the last N bytes
+            size_t length = std::strtoul(last.c_str(), nullptr, 10);
+            if (length == 0)
+                continue;
+            start = length >= size ? 0 : size - length;
+            stop = size - 1;
+        }
+        else {
+            start = std::strtoul(first.c_str(), nullptr, 10);
+            stop = last.empty() ? SIZE_MAX
+                : std::strtoul(last.c_str(), nullptr, 10);
+            if (stop < start)
+                return false;
+            if (start >= size)
+                continue;
+            stop = std::min(stop, size - 1);
+        }
+        ranges.emplace_back(start, stop);
+    }
+    return true;
+}
+
+void serve_image(const Request& request, Response& response)
+{
+    response.headers.emplace_back("ETag", etag);
+    response.headers.emplace_back("Accept-Ranges", "bytes");
+    response.headers.emplace_back("Content-Type", "application/octet-stream");
+
+    auto match = request.headers.find("if-none-match");
+    if (match != request.headers.end()
+        && (match->second == etag || match->second == "*")) {
+        response.status = 304;
+        return;
+    }
+
+    auto range = request.headers.find("range");
+    // A Range request for another version of the image gets the whole image
+    auto if_range = request.headers.find("if-range");
+    bool use_range = range != request.headers.end()
+        && (if_range == request.headers.end() || if_range->second == etag);
+    std::vector<std::pair<size_t, size_t>> ranges;
+    if (use_range && parse_ranges(range->second, image.size(), ranges)) {
+        if (ranges.empty()) {
+            response.status = 416;
+            response.headers.emplace_back("Content-Range",
+                "bytes */" + std::to_string(image.size()));
+            return;
+        }
+        response.status = 206;
+        if (ranges.size() == 1) {
+            size_t start = ranges[0].first;
+            size_t stop = ranges[0].second;
+            response.headers.emplace_back("Content-Range", "bytes "
+                + std::to_string(start) + "-" + std::to_string(stop) + "/"
+                + std::to_string(image.size()));
+            response.body = image.substr(start, stop - start + 1);
+        }
+        else {
+            // Replace the Content-Type set above
+            response.headers.pop_back();
+            response.headers.emplace_back("Content-Type",
+                std::string("multipart/byteranges; boundary=") + BOUNDARY);
+            for (const auto& part : ranges) {
+                response.body += std::string("\r\n--") + BOUNDARY + "\r\n"
+                    "Content-Type: application/octet-stream\r\n"
+                    "Content-Range: bytes " + std::to_string(part.first)
+                    + "-" + std::to_string(part.second) + "/"
+                    + std::to_string(image.size()) + "\r\n\r\n"
+                    + image.substr(part.first, part.second - part.first + 1);
+            }
+            response.body += std::string("\r\n--") + BOUNDARY + "--\r\n";
+        }
+    }
+    else {
+        response.body = image;
+    }
+}
+
+void serve_status(const Request& request, Response& response)
+{
+    std::string id = device_id(request, options.status_path);
+    bool pending;
+    {
+        std::lock_guard<std::mutex> lock(state_mutex);
+        pending = options.pending && cleared.count(id) == 0;
+    }
+    response.headers.emplace_back("Content-Type", "application/json");
+    if (pending) {
+        // The expected response is followed by the location of the image,
+        // for URL indirection
+        response.body = "{" + options.expected + "," + options.json_prefix
+            + options.image_path + "\"}";
+    }
+    else {
+        response.body = "{\"status\":0}";
+    }
+}
+
+void serve_manifest(const Request& request, Response& response)
+{
+    std::string id = device_id(request, options.manifest_path);
+    bool pending;
+    {
+        std::lock_guard<std::mutex> lock(state_mutex);
+        pending = options.pending && cleared.count(id) == 0;
+    }
+    response.headers.emplace_back("Content-Type", "application/json");
+    if (pending) {
+        bool packed = starts_with(image, PACKED_HEX_MARKER);
+        response.body = "{\"update\":1,\"path\":\"" + options.image_path
+            + "\",\"size\":" + std::to_string(image.size()) + ",\"crc\":"
+            + std::to_string(image_crc) + ",\"format\":\""
+            + (packed ? "packed" : "hex") + "\"}";
+    }
+    else {
+        response.body = "{\"update\":0}";
+    }
+}
+
+void serve_clear(const Request& request, Response& response)
+{
+    std::string id = device_id(request, options.clear_path);
+    {
+        std::lock_guard<std::mutex> lock(state_mutex);
+        cleared.insert(id);
+    }
+    std::string telemetry = query_value(request.query, "t");
+    if (!telemetry.empty()) {
+        std::lock_guard<std::mutex> lock(log_mutex);
+        std::printf("telemetry %s %s\n", id.c_str(), telemetry.c_str());
+    }
+    response.headers.emplace_back("Content-Type", "application/json");
+    response.body = "{\"status\":0}";
+}
+
+void route(const Request& request, Response& response)
+{
+    if (request.method != "GET" && request.method != "HEAD") {
+        response.status = 405;
+        response.headers.emplace_back("Allow", "GET, HEAD");
+        return;
+    }
+    response.head_only = request.method == "HEAD";
+    if (request.path == options.image_path)
+        serve_image(request, response);
+    else if (starts_with(request.target, options.status_path))
+        serve_status(request, response);
+    else if (starts_with(request.target, options.clear_path))
+        serve_clear(request, response);
+    else if (starts_with(request.target, options.manifest_path))
+        serve_manifest(request, response);
+    else
+        response.status = 404;
+}
+
+const char* reason(int status)
+{
+    switch (status) {
+        case 200: return "OK";
+        case 206: return "Partial Content";
+        case 304: return "Not Modified";
+        case 400: return "Bad Request";
+        case 404: return "Not Found";
+        case 405: return "Method Not Allowed";
+        case 416: return "Range Not Satisfiable";
+        default: return "Unknown";
+    }
+}
+
+/* Send a buffer, no faster than the configured bandwidth */
+bool send_all(int fd, const char* data, size_t size, Clock::time_point start,
+    size_t& sent)
+{
+    while (size > 0) {
+        size_t block = size;
+        if (options.bandwidth > 0) {
+            block = std::min(block, THROTTLE_BLOCK);
+            // Wait until the connection is allowed to send this block
+            auto due = start + std::chrono::microseconds(
+                (sent + block) * 1000000ULL / options.bandwidth);
+            std::this_thread::sleep_until(due);
+        }
+        ssize_t count = send(fd, data, block, MSG_NOSIGNAL);
+        if (count <= 0)
+            return false;
+        data += count;
+        size -= count;
+        sent += count;
+    }
+    return true;
+}
+
+/* Read one request, returns false when the connection is closed */
+bool read_request(int fd, std::string& pending, Request& request)
+{
+    size_t end;
+    while ((end = pending.find("\r\n\r\n")) == std::string::npos) {
+        char buffer[1024];
+        ssize_t count = recv(fd, buffer, sizeof(buffer), 0);
+        if (count <= 0)
+            return false;
+        pending.append(buffer, count);
+        if (pending.size() > 16384)
+            return false;
+    }
+    std::istringstream stream(pending.substr(0, end));
+    pending.erase(0, end + 4);
+
+    std::string line;
+    std::getline(stream, line);
+    std::istringstream request_line(trim(line));
+    std::string version;
+    request_line >> request.method >> request.target >> version;
+    size_t question = request.target.find('?');
+    request.path = request.target.substr(0, question);
+    if (question != std::string::npos)
+        request.query = request.target.substr(question + 1);
+    while (std::getline(stream, line)) {
+        size_t colon = line.find(':');
+        if (colon != std::string::npos)
+            request.headers[lowercase(line.substr(0, colon))] =
+                trim(line.substr(colon + 1));
+    }
+    return true;
+}
+
+void handle_connection(int fd, std::string peer)
+{
+    std::string pending;
+    unsigned index = 0;
+    while (true) {
+        Request request;
+        if (!read_request(fd, pending, request))
+            break;
+        Clock::time_point received = Clock::now();
+        ++index;
+
+        Response response;
+        if (request.method.empty() || request.target.empty())
+            response.status = 400;
+        else
+            route(request, response);
+
+        if (options.latency_ms > 0)
+            std::this_thread::sleep_for(
+                std::chrono::milliseconds(options.latency_ms));
+
+        std::string head = "HTTP/1.1 " + std::to_string(response.status)
+            + " " + reason(response.status) + "\r\n";
+        for (const auto& header : response.headers)
+            head += header.first + ": " + header.second + "\r\n";
+        head += "Content-Length: " + std::to_string(response.body.size())
+            + "\r\n\r\n";
+
+        Clock::time_point first_byte = Clock::now();
+        size_t sent = 0;
+        bool ok = send_all(fd, head.data(), head.size(), first_byte, sent);
+        if (ok && !response.head_only)
+            ok = send_all(fd, response.body.data(), response.body.size(),
+                first_byte, sent);
+        Clock::time_point done = Clock::now();
+
+        auto ms = [](Clock::duration duration) {
+            return std::chrono::duration<double, std::milli>(duration).count();
+        };
+        {
+            std::lock_guard<std::mutex> lock(log_mutex);
+            std::printf("%-21s #%-3u %-4s %-40s %d %7zu B  first %8.3f ms"
+                "  total %8.3f ms\n", peer.c_str(), index,
+                request.method.c_str(), request.target.c_str(),
+                response.status, sent, ms(first_byte - received),
+                ms(done - received));
+            if (options.verbose) {
+                auto range = request.headers.find("range");
+                if (range != request.headers.end())
+                    std::printf("%21s       Range: %s\n", "",
+                        range->second.c_str());
+            }
+            std::fflush(stdout);
+        }
+        if (!ok)
+            break;
+        auto connection = request.headers.find("connection");
+        if (connection != request.headers.end()
+            && lowercase(connection->second) == "close")
+            break;
+    }
+    close(fd);
+}
+
+/*
+ * CRC-16 of the data records of a HEX file, in the order in which reaDIYboot
+ * writes them to the Flash memory (_crc16_update, starting from 0xFFFF)
+ */
+uint16_t binary_crc16(const std::string& hex)
+{
+    uint16_t crc = 0xFFFF;
+    std::istringstream lines(hex);
+    std::string line;
+    while (std::getline(lines, line)) {
+        if (line.size() < 11 || line[0] != ':')
+            continue;
+        unsigned count = std::stoul(line.substr(1, 2), nullptr, 16);
+        if (line.compare(7, 2, "00") != 0 || line.size() < 9 + 2*count)
+            continue;
+        for (unsigned i = 0; i < count; i++) {
+            crc ^= std::stoul(line.substr(9 + 2*i, 2), nullptr, 16);
+            for (int bit = 0; bit < 8; bit++)
+                crc = crc & 1 ? (crc >> 1) ^ 0xA001 : crc >> 1;
+        }
+    }
+    return crc;
+}
+
+bool load_image(const char* path)
+{
+    std::ifstream file(path, std::ios::binary);
+    if (!file)
+        return false;
+    std::ostringstream content;
+    content << file.rdbuf();
+    image = content.str();
+    etag = content_etag(image);
+    image_crc = binary_crc16(image);
+    return true;
+}
+
+void usage(const char* program)
+{
+    std::fprintf(stderr,
+        "usage: %s [-p port] [-u image path] [-s status path]"
+        " [-c clear path]\n"
+        "       [-m manifest path] [-e expected response] [-j JSON prefix]\n"
+        "       [-n] [-l latency ms] [-b bandwidth B/s] [-v] <HEX file>\n",
+        program);
+}
+
+} // namespace
+
+int main(int argc, char** argv)
+{
+    int option;
+    while ((option = getopt(argc, argv, "p:u:s:c:m:e:j:nl:b:v")) != -1) {
+        switch (option) {
+            case 'p': options.port = std::atoi(optarg); break;
+            case 'u': options.image_path = optarg; break;
+            case 's': options.status_path = optarg; break;
+            case 'c': options.clear_path = optarg; break;
+            case 'm': options.manifest_path = optarg; break;
+            case 'e': options.expected = optarg; break;
+            case 'j': options.json_prefix = optarg; break;
+            case 'n': options.pending = false; break;
+            case 'l': options.latency_ms = std::atol(optarg); break;
+            case 'b': options.bandwidth = std::atol(optarg); break;
+            case 'v': options.verbose = true; break;
+            default: usage(argv[0]); return 2;
+        }
+    }
+    if (optind != argc - 1) {
+        usage(argv[0]);
+        return 2;
+    }
+    if (!load_image(argv[optind])) {
+        std::perror(argv[optind]);
+        return 1;
+    }
+    if (options.image_path.empty()) {
+        std::string name = argv[optind];
+        options.image_path = "/" + name.substr(name.find_last_of('/') + 1);
+    }
+
+    int server = socket(AF_INET, SOCK_STREAM, 0);
+    int yes = 1;
+    setsockopt(server, SOL_SOCKET, SO_REUSEADDR, &yes, sizeof(yes));
+    sockaddr_in address = {};
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_ANY);
+    address.sin_port = htons(options.port);
+    if (bind(server, reinterpret_cast<sockaddr*>(&address), sizeof(address))
+        != 0 || listen(server, 128) != 0) {
+        std::perror("bind");
+        return 1;
+    }
+    signal(SIGPIPE, SIG_IGN);
+    std::printf("serving %s (%zu bytes, ETag %s) at %s on port %d\n",
+        argv[optind], image.size(), etag.c_str(), options.image_path.c_str(),
+        options.port);
+    std::fflush(stdout);
+
+    while (true) {
+        sockaddr_in client;
+        socklen_t length = sizeof(client);
+        int fd = accept(server, reinterpret_cast<sockaddr*>(&client), &length);
+        if (fd < 0)
+            continue;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &yes, sizeof(yes));
+        timeval idle = {IDLE_TIMEOUT, 0};
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &idle, sizeof(idle));
+        char host[INET_ADDRSTRLEN];
+        inet_ntop(AF_INET, &client.sin_addr, host, sizeof(host));
+        std::string peer = std::string(host) + ":"
+            + std::to_string(ntohs(client.sin_port));
+        std::thread(handle_connection, fd, peer).detach();
+    }
+}
@@ -0,0 +1,685 @@
+/* reaDIYboot WiFly session recorder
+ * Copyright (C) 2011-2012 reaDIYmate
+ *
+ * This program is free software: you can redistribute it and/or modify it
+ * under the terms of the GNU General Public License as published by the Free
+ * Software Foundation, either version 3 of the License, or (at your option)
+ * any later version.
+ *
+ * This program is distributed in the hope that it will be useful, but
+ * WITHOUT ANY WARRANTY; without even the implied warranty of MERCHANTABILITY
+ * or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU General Public License
+ * for more details.
+ *
+ * You should have received a copy of the GNU General Public License along
+ * with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/*
+ * Record the traffic between reaDIYboot and the WiFly module, and play the
+ * WiFly side of it back to an emulated or real board with the same timing.
+ *
+ * A session is a text file with one event per line, the time being in
+ * microseconds from the start of the session:
+ *
+ *     <time> T <hex bytes>     bytes sent by the bootloader on UART1
+ *     <time> R <hex bytes>     bytes sent by the WiFly
+ *     <time> G4 <level>        level of the GPIO4 pin of the WiFly
+ *     <time> G6 <level>        level of the GPIO6 pin of the WiFly
+ *
+ * Lines starting with '#' are ignored.
+ *
+ * Usage:
+ *     wifly_session import [-t label] [-r label] [-4 label] [-6 label]
+ *                          [-m gap] <export.csv>...
+ *     wifly_session record [-b baud] <board port> <WiFly port>
+ *     wifly_session replay [-b baud] [-w wait] [-l limit] [-g gpio file]
+ *                          [-e command] <session> [board port]
+ */
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <csignal>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/ioctl.h>
+#include <sys/wait.h>
+#include <termios.h>
+#include <unistd.h>
+
+namespace {
+
+enum EventType { EVENT_TX, EVENT_RX, EVENT_GPIO4, EVENT_GPIO6 };
+
+const char* const EVENT_NAMES[] = {"T", "R", "G4", "G6"};
+
+struct Event {
+    uint64_t time;
+    EventType type;
+    std::vector<uint8_t> bytes;
+};
+
+typedef std::chrono::steady_clock Clock;
+
+volatile std::sig_atomic_t interrupted = 0;
+
+void on_interrupt(int)
+{
+    interrupted = 1;
+}
+
+speed_t baud_constant(long baud)
+{
+    switch (baud) {
+        case 9600: return B9600;
+        case 19200: return B19200;
+        case 38400: return B38400;
+        case 57600: return B57600;
+        case 115200: return B115200;
+        case 230400: return B230400;
+        case 460800: return B460800;
+        case 500000: return B500000;
+        case 921600: return B921600;
+        default: return B0;
+    }
+}
+
+bool configure_tty(int fd, long baud)
+{
+    struct termios tio;
+    if (tcgetattr(fd, &tio) != 0)
+        return false;
+    cfmakeraw(&tio);
+    speed_t speed = baud_constant(baud);
+    if (speed == B0) {
+        std::fprintf(stderr, "unsupported baud rate %ld\n", baud);
+        return false;
+    }
+    cfsetispeed(&tio, speed);
+    cfsetospeed(&tio, speed);
+    tio.c_cc[VMIN] = 1;
+    tio.c_cc[VTIME] = 0;
+    return tcsetattr(fd, TCSANOW, &tio) == 0;
+}
+
+int open_port(const char* path, long baud)
+{
+    int fd = open(path, O_RDWR | O_NOCTTY);
+    if (fd < 0) {
+        std::perror(path);
+        return -1;
+    }
+    if (!configure_tty(fd, baud)) {
+        std::fprintf(stderr, "%s: cannot configure the port\n", path);
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+void write_all(int fd, const uint8_t* data, size_t size)
+{
+    while (size > 0) {
+        ssize_t n = write(fd, data, size);
+        if (n < 0) {
+            if (errno == EINTR || errno == EAGAIN)
+                continue;
+            std::perror("write");
+            return;
+        }
+        data += n;
+        size -= n;
+    }
+}
+
+void put_event(std::FILE* output, const Event& event)
+{
+    std::fprintf(output, "%llu %s",
+        static_cast<unsigned long long>(event.time), EVENT_NAMES[event.type]);
+    if (event.type == EVENT_TX || event.type == EVENT_RX) {
+        std::fputc(' ', output);
+        for (uint8_t byte : event.bytes)
+            std::fprintf(output, "%02X", byte);
+    }
+    else
+        std::fprintf(output, " %u", event.bytes[0]);
+    std::fputc('\n', output);
+}
+
+bool load_session(const char* path, std::vector<Event>& events)
+{
+    std::ifstream file(path);
+    if (!file) {
+        std::perror(path);
+        return false;
+    }
+    std::string line;
+    unsigned number = 0;
+    while (std::getline(file, line)) {
+        ++number;
+        if (line.empty() || line[0] == '#')
+            continue;
+        std::istringstream fields(line);
+        Event event;
+        std::string type, value;
+        if (!(fields >> event.time >> type >> value)) {
+            std::fprintf(stderr, "%s:%u: malformed event\n", path, number);
+            return false;
+        }
+        auto name = std::find(std::begin(EVENT_NAMES), std::end(EVENT_NAMES),
+            type);
+        if (name == std::end(EVENT_NAMES)) {
+            std::fprintf(stderr, "%s:%u: unknown event %s\n", path, number,
+                type.c_str());
+            return false;
+        }
+        event.type = static_cast<EventType>(name - std::begin(EVENT_NAMES));
+        if (event.type == EVENT_GPIO4 || event.type == EVENT_GPIO6)
+            event.bytes.push_back(value != "0");
+        else {
+            for (size_t i = 0; i + 1 < value.size(); i += 2)
+                event.bytes.push_back(
+                    std::strtoul(value.substr(i, 2).c_str(), nullptr, 16));
+            if (event.bytes.empty() || value.size() % 2) {
+                std::fprintf(stderr, "%s:%u: malformed bytes\n", path,
+                    number);
+                return false;
+            }
+        }
+        events.push_back(event);
+    }
+    return true;
+}
+
+std::vector<std::string> split_csv(const std::string& line)
+{
+    std::vector<std::string> fields(1);
+    bool quoted = false;
+    for (char c : line) {
+        if (c == '"')
+            quoted = !quoted;
+        else if (c == ',' && !quoted)
+            fields.emplace_back();
+        else if (c != '\r')
+            fields.back() += c;
+    }
+    for (std::string& field : fields) {
+        size_t first = field.find_first_not_of(' ');
+        field.erase(0, first == std::string::npos ? field.size() : first);
+    }
+    return fields;
+}
+
+/* Decode a byte exported by an analyzer: 0x41, 65, 'A', A or \r */
+bool parse_exported_byte(const std::string& text, uint8_t& byte)
+{
+    const std::string& value = text;
+    if (value.size() == 3 && value[0] == '\'' && value[2] == '\'') {
+        byte = value[1];
+        return true;
+    }
+    if (value.size() == 1 && !(value[0] >= '0' && value[0] <= '9')) {
+        byte = value[0];
+        return true;
+    }
+    if (value == "\\r" || value == "\\n" || value == "\\t") {
+        byte = value[1] == 'r' ? '\r' : value[1] == 'n' ? '\n' : '\t';
+        return true;
+    }
+    char* end;
+    unsigned long number = std::strtoul(value.c_str(), &end, 0);
+    if (value.empty() || *end != '\0' || number > 0xFF)
+        return false;
+    byte = number;
+    return true;
+}
+
+/* Append the events of a logic analyzer export, labels being indexed by type */
+bool import_file(const char* path, const char* const* labels,
+    std::vector<Event>& events)
+{
+    std::ifstream file(path);
+    if (!file) {
+        std::perror(path);
+        return false;
+    }
+
+    auto label_type = [&labels](const std::string& label) {
+        for (int type = EVENT_TX; type <= EVENT_GPIO6; type++) {
+            if (label == labels[type])
+                return type;
+        }
+        return -1;
+    };
+    auto add = [&events](double seconds, int type, uint8_t value) {
+        events.push_back(Event{static_cast<uint64_t>(seconds * 1e6 + 0.5),
+            static_cast<EventType>(type), std::vector<uint8_t>(1, value)});
+    };
+
+    // Three formats are accepted: rows of "time,label,value" without a
+    // header, the export of the serial analyzers of a logic analyzer (with
+    // "name", "start_time" and "data" columns), and the export of its
+    // digital channels (a time column and one column per channel)
+    std::string line;
+    std::getline(file, line);
+    std::vector<std::string> header = split_csv(line);
+    bool has_header = std::strtod(header[0].c_str(), nullptr) == 0.0
+        && !(header[0].size() > 0 && header[0][0] == '0');
+    int name_column = -1, time_column = -1, data_column = -1;
+    std::vector<int> channel_types(header.size(), -1);
+    for (size_t i = 0; has_header && i < header.size(); i++) {
+        std::string column = header[i];
+        std::transform(column.begin(), column.end(), column.begin(),
+            ::tolower);
+        if (column == "name")
+            name_column = i;
+        else if (column == "start_time" || column == "time"
+            || column.compare(0, 4, "time") == 0)
+            time_column = i;
+        else if (column == "data" || column == "value")
+            data_column = i;
+        channel_types[i] = label_type(header[i]);
+    }
+    if (!has_header) {
+        name_column = 1;
+        time_column = 0;
+        data_column = 2;
+    }
+    if (time_column < 0) {
+        std::fprintf(stderr, "%s: no time column\n", path);
+        return false;
+    }
+    bool digital = name_column < 0;
+    std::vector<int> levels(header.size(), -1);
+    unsigned number = 1;
+    do {
+        if (has_header && number == 1)
+            continue;
+        std::vector<std::string> fields = split_csv(line);
+        if (fields.size() <= static_cast<size_t>(time_column))
+            continue;
+        double seconds = std::strtod(fields[time_column].c_str(), nullptr);
+        if (digital) {
+            for (size_t i = 0; i < fields.size() && i < header.size(); i++) {
+                if (channel_types[i] < EVENT_GPIO4)
+                    continue;
+                int level = std::atoi(fields[i].c_str()) != 0;
+                if (level != levels[i])
+                    add(seconds, channel_types[i], level);
+                levels[i] = level;
+            }
+            continue;
+        }
+        if (fields.size() <= static_cast<size_t>(
+            std::max(name_column, data_column)))
+            continue;
+        int type = label_type(fields[name_column]);
+        uint8_t value;
+        if (type < 0)
+            continue;
+        if (!parse_exported_byte(fields[data_column], value)) {
+            std::fprintf(stderr, "%s:%u: cannot decode %s\n", path, number,
+                fields[data_column].c_str());
+            return false;
+        }
+        add(seconds, type, type >= EVENT_GPIO4 ? value != 0 : value);
+    } while (++number, std::getline(file, line));
+    return true;
+}
+
+int import(int argc, char** argv)
+{
+    const char* labels[] = {"TX", "RX", "GPIO4", "GPIO6"};
+    // Bytes closer than this in microseconds are merged in one event
+    uint64_t gap = 1000;
+    int option;
+    while ((option = getopt(argc, argv, "t:r:4:6:m:")) != -1) {
+        switch (option) {
+            case 't': labels[EVENT_TX] = optarg; break;
+            case 'r': labels[EVENT_RX] = optarg; break;
+            case '4': labels[EVENT_GPIO4] = optarg; break;
+            case '6': labels[EVENT_GPIO6] = optarg; break;
+            case 'm': gap = std::strtoull(optarg, nullptr, 0); break;
+            default: return 2;
+        }
+    }
+    if (optind >= argc) {
+        std::fprintf(stderr, "usage: %s import [-t label] [-r label] "
+            "[-4 label] [-6 label] [-m gap] <export.csv>...\n", argv[0]);
+        return 2;
+    }
+    // The exports of a capture share the same time base
+    std::vector<Event> events;
+    for (int i = optind; i < argc; i++) {
+        if (!import_file(argv[i], labels, events))
+            return 1;
+    }
+
+    std::stable_sort(events.begin(), events.end(),
+        [](const Event& a, const Event& b) { return a.time < b.time; });
+    uint64_t start = events.empty() ? 0 : events.front().time;
+    std::printf("# WiFly session imported from %s\n", argv[optind]);
+    for (size_t i = 0; i < events.size(); ) {
+        Event event = events[i++];
+        uint64_t last = event.time;
+        // Merge the bytes of a burst in the same direction
+        while (event.type <= EVENT_RX && i < events.size()
+            && events[i].type == event.type && events[i].time - last < gap) {
+            last = events[i].time;
+            event.bytes.push_back(events[i++].bytes[0]);
+        }
+        event.time -= start;
+        put_event(stdout, event);
+    }
+    return 0;
+}
+
+/* Levels of the GPIO pins read from the modem lines of a USB serial adapter */
+const int GPIO4_INPUT = TIOCM_DSR;
+const int GPIO6_INPUT = TIOCM_CAR;
+const int GPIO4_OUTPUT = TIOCM_DTR;
+const int GPIO6_OUTPUT = TIOCM_RTS;
+
+/* Drive a modem line, which is active low on a USB serial adapter */
+void set_modem_line(int fd, int line, bool level)
+{
+    ioctl(fd, level ? TIOCMBIC : TIOCMBIS, &line);
+}
+
+int record(int argc, char** argv)
+{
+    long baud = 115200;
+    int option;
+    while ((option = getopt(argc, argv, "b:")) != -1) {
+        if (option == 'b')
+            baud = std::strtol(optarg, nullptr, 10);
+        else
+            return 2;
+    }
+    if (optind != argc - 2) {
+        std::fprintf(stderr,
+            "usage: %s record [-b baud] <board port> <WiFly port>\n", argv[0]);
+        return 2;
+    }
+    int board = open_port(argv[optind], baud);
+    int wifly = open_port(argv[optind + 1], baud);
+    if (board < 0 || wifly < 0)
+        return 1;
+
+    std::signal(SIGINT, on_interrupt);
+    std::printf("# WiFly session recorded at %ld baud\n", baud);
+    Clock::time_point start = Clock::now();
+    auto now = [start]() {
+        return static_cast<uint64_t>(
+            std::chrono::duration_cast<std::chrono::microseconds>(
+                Clock::now() - start).count());
+    };
+    int levels[2] = {-1, -1};
+    struct pollfd fds[2] = {{board, POLLIN, 0}, {wifly, POLLIN, 0}};
+    unsigned long bytes[2] = {0, 0};
+    while (!interrupted) {
+        // The modem lines are polled every millisecond
+        if (poll(fds, 2, 1) < 0 && errno != EINTR) {
+            std::perror("poll");
+            break;
+        }
+        for (int side = 0; side < 2; side++) {
+            if (!(fds[side].revents & POLLIN))
+                continue;
+            uint8_t buffer[256];
+            ssize_t n = read(fds[side].fd, buffer, sizeof(buffer));
+            if (n <= 0)
+                continue;
+            Event event{now(), side == 0 ? EVENT_TX : EVENT_RX,
+                std::vector<uint8_t>(buffer, buffer + n)};
+            write_all(side == 0 ? wifly : board, buffer, n);
+            put_event(stdout, event);
+            bytes[side] += n;
+        }
+        int lines;
+        if (ioctl(wifly, TIOCMGET, &lines) != 0)
+            continue;
+        const int inputs[2] = {GPIO4_INPUT, GPIO6_INPUT};
+        const int outputs[2] = {GPIO4_OUTPUT, GPIO6_OUTPUT};
+        for (int pin = 0; pin < 2; pin++) {
+            int level = !(lines & inputs[pin]);
+            if (level == levels[pin])
+                continue;
+            levels[pin] = level;
+            set_modem_line(board, outputs[pin], level);
+            Event event{now(), pin == 0 ? EVENT_GPIO4 : EVENT_GPIO6,
+                std::vector<uint8_t>(1, level)};
+            put_event(stdout, event);
+        }
+        std::fflush(stdout);
+    }
+    std::fprintf(stderr, "%lu bytes from the board, %lu from the WiFly in "
+        "%.3f s\n", bytes[0], bytes[1], now() / 1e6);
+    return 0;
+}
+
+int open_pty(std::string& name)
+{
+    int fd = posix_openpt(O_RDWR | O_NOCTTY);
+    if (fd < 0 || grantpt(fd) != 0 || unlockpt(fd) != 0) {
+        std::perror("posix_openpt");
+        return -1;
+    }
+    name = ptsname(fd);
+    struct termios tio;
+    tcgetattr(fd, &tio);
+    cfmakeraw(&tio);
+    tcsetattr(fd, TCSANOW, &tio);
+    return fd;
+}
+
+pid_t run_command(std::string command, const std::string& port)
+{
+    size_t position = command.find("%s");
+    if (position != std::string::npos)
+        command.replace(position, 2, port);
+    pid_t pid = fork();
+    if (pid == 0) {
+        setenv("WIFLY_PORT", port.c_str(), 1);
+        execl("/bin/sh", "sh", "-c", command.c_str(), (char*)nullptr);
+        _exit(127);
+    }
+    return pid;
+}
+
+std::string hex_string(const uint8_t* data, size_t size)
+{
+    std::string text;
+    char digits[3];
+    for (size_t i = 0; i < size; i++) {
+        std::snprintf(digits, sizeof(digits), "%02X", data[i]);
+        text += digits;
+    }
+    return text;
+}
+
+int replay(int argc, char** argv)
+{
+    long baud = 115200;
+    double wait = 30.0;
+    double limit = 0.0;
+    const char* gpio_path = nullptr;
+    const char* command = nullptr;
+    int option;
+    while ((option = getopt(argc, argv, "b:w:l:g:e:")) != -1) {
+        switch (option) {
+            case 'b': baud = std::strtol(optarg, nullptr, 10); break;
+            case 'w': wait = std::strtod(optarg, nullptr); break;
+            case 'l': limit = std::strtod(optarg, nullptr); break;
+            case 'g': gpio_path = optarg; break;
+            case 'e': command = optarg; break;
+            default: return 2;
+        }
+    }
+    if (optind != argc - 1 && optind != argc - 2) {
+        std::fprintf(stderr, "usage: %s replay [-b baud] [-w wait] "
+            "[-l limit] [-g gpio file] [-e command] <session> [board port]\n",
+            argv[0]);
+        return 2;
+    }
+    const char* session = argv[optind];
+    std::vector<Event> events;
+    if (!load_session(session, events))
+        return 1;
+
+    std::string port;
+    int fd;
+    bool serial = optind == argc - 2;
+    if (serial) {
+        port = argv[optind + 1];
+        fd = open_port(port.c_str(), baud);
+    }
+    else {
+        fd = open_pty(port);
+        if (fd >= 0)
+            std::fprintf(stderr, "WiFly side on %s\n", port.c_str());
+    }
+    if (fd < 0)
+        return 1;
+    std::FILE* gpio = gpio_path ? std::fopen(gpio_path, "w") : nullptr;
+    if (gpio_path && !gpio) {
+        std::perror(gpio_path);
+        return 1;
+    }
+    std::signal(SIGINT, on_interrupt);
+    pid_t child = command ? run_command(command, port) : -1;
+
+    // The WiFly side is replayed relative to the last bytes received from
+    // the board, so a faster or slower bootloader shifts the rest of the
+    // session instead of desynchronizing it
+    Clock::time_point start = Clock::now();
+    Clock::time_point anchor = start;
+    uint64_t anchor_time = events.empty() ? 0 : events.front().time;
+    uint64_t first_time = anchor_time;
+    std::vector<uint8_t> received;
+    size_t offset = 0;
+    int status = 0;
+    for (size_t i = 0; i < events.size() && !interrupted && status == 0; i++) {
+        const Event& event = events[i];
+        if (event.type != EVENT_TX) {
+            Clock::time_point due = anchor
+                + std::chrono::microseconds(event.time - anchor_time);
+            while (Clock::now() < due && !interrupted) {
+                // Keep draining the board side while waiting
+                struct pollfd pfd = {fd, POLLIN, 0};
+                int ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+                    due - Clock::now()).count();
+                if (poll(&pfd, 1, std::max(ms, 0)) > 0) {
+                    uint8_t buffer[256];
+                    ssize_t n = read(fd, buffer, sizeof(buffer));
+                    if (n > 0)
+                        received.insert(received.end(), buffer, buffer + n);
+                }
+            }
+            if (event.type == EVENT_RX)
+                write_all(fd, event.bytes.data(), event.bytes.size());
+            else {
+                if (serial)
+                    set_modem_line(fd, event.type == EVENT_GPIO4
+                        ? GPIO4_OUTPUT : GPIO6_OUTPUT, event.bytes[0]);
+                if (gpio) {
+                    std::fprintf(gpio, "%lld %s %u\n",
+                        static_cast<long long>(std::chrono::duration_cast<
+                            std::chrono::microseconds>(Clock::now() - start)
+                            .count()),
+                        event.type == EVENT_GPIO4 ? "GPIO4" : "GPIO6",
+                        event.bytes[0]);
+                    std::fflush(gpio);
+                }
+            }
+            continue;
+        }
+        // Wait for the bytes sent by the bootloader in the session
+        Clock::time_point deadline = Clock::now()
+            + std::chrono::microseconds(static_cast<int64_t>(wait * 1e6));
+        while (received.size() - offset < event.bytes.size()) {
+            if (interrupted || Clock::now() >= deadline) {
+                std::fprintf(stderr, "%s: event %zu: waited %.1f s for %s, "
+                    "received %s\n", session, i + 1, wait,
+                    hex_string(event.bytes.data(), event.bytes.size()).c_str(),
+                    hex_string(received.data() + offset,
+                        received.size() - offset).c_str());
+                status = 1;
+                break;
+            }
+            struct pollfd pfd = {fd, POLLIN, 0};
+            if (poll(&pfd, 1, 10) > 0) {
+                uint8_t buffer[256];
+                ssize_t n = read(fd, buffer, sizeof(buffer));
+                if (n > 0)
+                    received.insert(received.end(), buffer, buffer + n);
+            }
+        }
+        if (status != 0)
+            break;
+        if (!std::equal(event.bytes.begin(), event.bytes.end(),
+            received.begin() + offset)) {
+            std::fprintf(stderr, "%s: event %zu: the board diverged from the "
+                "session, expected %s, received %s\n", session, i + 1,
+                hex_string(event.bytes.data(), event.bytes.size()).c_str(),
+                hex_string(received.data() + offset,
+                    event.bytes.size()).c_str());
+            status = 1;
+            break;
+        }
+        offset += event.bytes.size();
+        anchor = Clock::now();
+        anchor_time = event.time;
+    }
+
+    double recorded = events.empty() ? 0.0
+        : (events.back().time - first_time) / 1e6;
+    double replayed = std::chrono::duration<double>(anchor - start).count();
+    if (interrupted)
+        status = 1;
+    if (status == 0) {
+        std::printf("%s: recorded %.3f s, replayed %.3f s (%+.1f%%)\n",
+            session, recorded, replayed,
+            recorded > 0 ? (replayed / recorded - 1) * 100 : 0.0);
+        if (limit > 0 && replayed > limit) {
+            std::printf("%s: over the limit of %.3f s\n", session, limit);
+            status = 1;
+        }
+    }
+    if (child > 0) {
+        kill(child, SIGTERM);
+        waitpid(child, nullptr, 0);
+    }
+    if (gpio)
+        std::fclose(gpio);
+    close(fd);
+    return status;
+}
+
+} // namespace
+
+int main(int argc, char** argv)
+{
+    std::string mode = argc > 1 ? argv[1] : "";
+    if (mode == "import" || mode == "record" || mode == "replay") {
+        // Let getopt parse the arguments that follow the mode
+        argv[1] = argv[0];
+        if (mode == "import")
+            return import(argc - 1, argv + 1);
+        if (mode == "record")
+            return record(argc - 1, argv + 1);
+        return replay(argc - 1, argv + 1);
+    }
+    std::fprintf(stderr, "usage: %s import|record|replay [options]\n",
+        argv[0]);
+    return 2;
+}